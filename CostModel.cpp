@@ -0,0 +1,185 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// The cost model shared by the SMT and non-SMT backends: per
+// architecture costs for the things we can insert and an estimate of
+// how often each CFG edge is traversed.
+
+#include "sassert.h"
+#include "RMCInternal.h"
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/CFG.h>
+
+#include <cmath>
+#include <exception>
+
+#undef NDEBUG
+#include <assert.h>
+
+using namespace llvm;
+
+namespace llvm {
+
+// Costs for different sorts of things that we insert.
+// XXX: These numbers are just made up.
+// And will vary based on platform.
+// (sync == lwsync on ARM but not on POWER and *definitely* not on x86)
+
+// Screw you, C++, for not having designated initializers
+TuningParams x86Params() {
+  TuningParams p;
+  p.syncCost = 800;
+  // this "lwsync" is really just a compiler barrier on x86
+  p.lwsyncCost = 500;
+  // ponder: maybe using release/acquire would be better for compiler
+  // reasons.
+  return p;
+}
+TuningParams powerParams() {
+  TuningParams p;
+  p.syncCost = 800;
+  p.lwsyncCost = 500;
+  p.isyncCost = 200;
+  p.useCtrlCost = 1;
+  p.addCtrlCost = 70;
+  p.useDataCost = 1;
+  p.addDataCost = 30; // eor+add
+  return p;
+}
+TuningParams armParams() {
+  TuningParams p;
+  p.syncCost = 500;
+  p.dmbstCost = 350; // XXX???
+  p.useCtrlCost = 1;
+  p.addCtrlCost = 70;
+  p.useDataCost = 1;
+  p.addDataCost = 30; // eor+add
+  return p;
+}
+TuningParams armv8Params() {
+  TuningParams p;
+  p.syncCost = 800;
+  p.lwsyncCost = 500;
+  p.dmbstCost = 350; // XXX???
+  p.dmbldCost = 300; // XXX???
+  p.useCtrlCost = 1;
+  p.addCtrlCost = 70;
+  p.useDataCost = 1;
+  p.addDataCost = 30; // eor+add
+  // cmp+csel: doesn't need a branch or to mess with the address
+  p.addCselCost = 20;
+  p.makeReleaseCost = 240;
+  p.makeAcquireCost = 240;
+  p.relAbuse = true;
+  return p;
+}
+
+TuningParams archParams(RMCTarget target) {
+  if (target == TargetX86) {
+    return x86Params();
+  } else if (target == TargetPOWER) {
+    return powerParams();
+  } else if (target == TargetARM) {
+    return armParams();
+  } else if (target == TargetARMv8) {
+    return armv8Params();
+  }
+  assert(false && "invalid architecture!");
+  std::terminate();
+}
+
+// The relative likelihood of leaving block for target, out of the
+// sum of this over all of block's successors.
+int successorWeight(const LoopInfo &loops,
+                    BasicBlock *block, BasicBlock *target) {
+  // If the block is a loop exit block, we make the probability
+  // higher for exits that stay in the loop.
+  // TODO: handle loop nesting in a smarter way.
+  auto *loop = loops[block];
+  if (!loop) return 1;
+  if (target == loop->getHeader() && loop->hasNoExitBlocks()) return 0;
+  if (!loop->isLoopExiting(block)) return 1;
+  // XXX: Is this logic inverted?
+  return loops[target] == loop ? 1 : 4;
+}
+
+// Solve the same flow equations that the SMT computeCapacities
+// does, but numerically, so that we don't need a solver to get edge
+// weights. We inject one unit of flow at the entry block, propagate it
+// until it settles and then scale everything up so that the smallest
+// nonzero capacity is 1, which is more or less what the solver gives
+// us.
+// (Returns get absorbed instead of flowing back to the entry, which
+// comes out the same as the SMT version's fictional back edges
+// whenever the function doesn't have infinite loops.)
+const int kCapacityIterations = 1000;
+const double kCapacityEpsilon = 1e-9;
+const double kMaxCapacityScale = 1 << 20;
+
+CapacityMap estimateCapacities(const LoopInfo &loops, Function &F) {
+  BasicBlock *entryBlock = &F.getEntryBlock();
+
+  // Precompute the branch probabilities
+  DenseMap<EdgeKey, double> prob;
+  for (auto & block : F) {
+    int denominator = 0;
+    for (auto *succ : successors(&block)) {
+      denominator += successorWeight(loops, &block, succ);
+    }
+    if (denominator == 0) denominator = 1;
+    for (auto *succ : successors(&block)) {
+      prob[std::make_pair(&block, succ)] =
+        (double)successorWeight(loops, &block, succ) / denominator;
+    }
+  }
+
+  DenseMap<BasicBlock *, double> nodeCap;
+  for (int iter = 0; iter < kCapacityIterations; iter++) {
+    double change = 0;
+    for (auto & block : F) {
+      double cap = &block == entryBlock ? 1.0 : 0.0;
+      for (auto *pred : predecessors(&block)) {
+        cap += nodeCap[pred] * prob[std::make_pair(pred, &block)];
+      }
+      change = std::max(change, std::fabs(cap - nodeCap[&block]));
+      nodeCap[&block] = cap;
+    }
+    if (change < kCapacityEpsilon) break;
+  }
+
+  DenseMap<EdgeKey, double> caps;
+  for (auto & block : F) {
+    bool hasSuccs = false;
+    for (auto *succ : successors(&block)) {
+      hasSuccs = true;
+      caps[std::make_pair(&block, succ)] =
+        nodeCap[&block] * prob[std::make_pair(&block, succ)];
+    }
+    // The fictional back edges from returns to the function entry
+    if (!hasSuccs) {
+      caps[std::make_pair(&block, entryBlock)] = nodeCap[&block];
+    }
+    // Cram the node weights in with <block, nullptr> keys
+    caps[std::make_pair(&block, (BasicBlock *)nullptr)] = nodeCap[&block];
+  }
+
+  double smallest = 1.0;
+  for (auto & entry : caps) {
+    if (entry.second > kCapacityEpsilon && entry.second < smallest) {
+      smallest = entry.second;
+    }
+  }
+  double scale = std::min(1.0 / smallest, kMaxCapacityScale);
+
+  CapacityMap intCaps;
+  for (auto & entry : caps) {
+    int cap = entry.second > kCapacityEpsilon ?
+      std::max(1L, std::lround(entry.second * scale)) : 0;
+    intCaps.insert(std::make_pair(entry.first, cap));
+  }
+  return intCaps;
+}
+
+}
@@ -0,0 +1,207 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// A machine level pass that checks that the dependencies we rely on
+// survived instruction selection, and puts in a barrier when one
+// didn't.
+//
+// The IR pass (with -rmc-dep-markers) leaves an empty asm that uses
+// the load right before each access (or terminator, for a ctrl dep)
+// that needs to depend on it. We run on SSA machine code, right after
+// instruction selection, and check that the first memory access or
+// terminator after each marker still has an operand computed from the
+// load. If not, we stick an lwsync equivalent where the marker was,
+// which is always strong enough for an execution edge. Then we delete
+// the marker so it doesn't tie up a register.
+//
+// There isn't any way for a plugin to put a pass in the middle of the
+// codegen pipeline, so this needs to be run by hand:
+//   llc -stop-after=finalize-isel foo.ll -o foo.mir
+//   llc -load RMC.so -run-pass=check-rmc-deps foo.mir -o foo2.mir
+//   llc -start-after=finalize-isel foo2.mir
+// That makes this a debugging tool, not part of any real build, and
+// rmc-config doesn't have a flag for it. The markers themselves get
+// in the way: they keep the load in a register and act as compiler
+// barriers, so the code being checked isn't quite the code we would
+// have generated without them. The "first access after the marker"
+// rule can also pick up some unrelated access that got scheduled in
+// between. And we only look right after isel, so anything the post-RA
+// peepholes do to a dependency goes unchecked.
+
+#include "RMCInternal.h"
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/CodeGen/MachineFunctionPass.h>
+#include <llvm/CodeGen/MachineInstrBuilder.h>
+#include <llvm/CodeGen/MachineRegisterInfo.h>
+#include <llvm/CodeGen/TargetInstrInfo.h>
+#include <llvm/CodeGen/TargetRegisterInfo.h>
+#include <llvm/CodeGen/TargetSubtargetInfo.h>
+#include <llvm/IR/InlineAsm.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/raw_ostream.h>
+
+#undef NDEBUG
+#include <assert.h>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "rmc"
+
+STATISTIC(NumDepsChecked, "Number of RMC dependencies checked");
+STATISTIC(NumDepsRepaired, "Number of RMC dependencies replaced by barriers");
+
+extern cl::opt<bool> DebugSpew;
+
+namespace {
+
+// How far back through the data flow we look before giving up
+const int kMaxDepDepth = 32;
+
+bool isAsmWith(const MachineInstr &mi, const char *string) {
+  if (!mi.isInlineAsm()) return false;
+  const MachineOperand &op = mi.getOperand(InlineAsm::MIOp_AsmString);
+  return op.isSymbol() && StringRef(op.getSymbolName()).contains(string);
+}
+
+// The first register an inline asm uses
+Register asmInput(const MachineInstr &mi) {
+  for (auto & op : mi.uses()) {
+    if (op.isReg() && op.getReg().isVirtual()) return op.getReg();
+  }
+  return Register();
+}
+
+class CheckRMCDepsPass : public MachineFunctionPass {
+public:
+  static char ID;
+  CheckRMCDepsPass() : MachineFunctionPass(ID) {}
+
+  StringRef getPassName() const override { return "Check RMC dependencies"; }
+
+  bool runOnMachineFunction(MachineFunction &MF) override;
+
+private:
+  MachineRegisterInfo *MRI_;
+  const TargetRegisterInfo *TRI_;
+
+  MachineInstr *findSource(Register reg);
+  bool dependsOn(MachineInstr *mi, MachineInstr *src, int depth,
+                 SmallPtrSetImpl<MachineInstr *> &seen);
+};
+
+// Find what actually computed a value, looking through copies (ours
+// and llvm's).
+MachineInstr *CheckRMCDepsPass::findSource(Register reg) {
+  MachineInstr *def = MRI_->getVRegDef(reg);
+  while (def && (def->isCopy() || isAsmWith(*def, "bs_copy"))) {
+    Register from = def->isCopy() ?
+      def->getOperand(1).getReg() : asmInput(*def);
+    if (!from.isVirtual()) break;
+    def = MRI_->getVRegDef(from);
+  }
+  return def;
+}
+
+// Is anything mi uses computed from src? We count any path through
+// the data flow; the IR pass already did the hard work of figuring out
+// that the dependency holds on the paths that matter, and what we are
+// looking for is the backend having gotten rid of it entirely.
+bool CheckRMCDepsPass::dependsOn(MachineInstr *mi, MachineInstr *src,
+                                 int depth,
+                                 SmallPtrSetImpl<MachineInstr *> &seen) {
+  if (mi == src) return true;
+  if (depth == 0 || !seen.insert(mi).second) return false;
+  for (auto & op : mi->uses()) {
+    if (!op.isReg() || !op.getReg()) continue;
+    MachineInstr *def = nullptr;
+    if (op.getReg().isVirtual()) {
+      def = MRI_->getVRegDef(op.getReg());
+    } else {
+      // Physical registers (like condition flags) come from the most
+      // recent thing in the block that writes them.
+      MachineBasicBlock::reverse_iterator i(mi);
+      for (auto e = mi->getParent()->rend(); i != e; ++i) {
+        if (&*i != mi && i->modifiesRegister(op.getReg(), TRI_)) {
+          def = &*i;
+          break;
+        }
+      }
+    }
+    if (def && dependsOn(def, src, depth - 1, seen)) return true;
+  }
+  return false;
+}
+
+bool CheckRMCDepsPass::runOnMachineFunction(MachineFunction &MF) {
+  MRI_ = &MF.getRegInfo();
+  TRI_ = MF.getSubtarget().getRegisterInfo();
+  const TargetInstrInfo *TII = MF.getSubtarget().getInstrInfo();
+  // We need SSA to follow the data flow.
+  if (!MRI_->isSSA()) return false;
+  RMCTarget target =
+    targetFromTriple(MF.getFunction().getParent()->getTargetTriple());
+
+  std::vector<MachineInstr *> markers;
+  for (auto & block : MF) {
+    for (auto & mi : block) {
+      if (isAsmWith(mi, kDepMarker)) markers.push_back(&mi);
+    }
+  }
+
+  for (MachineInstr *marker : markers) {
+    NumDepsChecked++;
+    MachineBasicBlock *block = marker->getParent();
+    MachineInstr *src = nullptr;
+    if (Register reg = asmInput(*marker)) src = findSource(reg);
+
+    // The access is the next thing that touches memory or branches.
+    // If it isn't in the block anymore, we assume the worst.
+    MachineInstr *access = nullptr;
+    MachineBasicBlock::iterator i(marker);
+    for (++i; i != block->end(); ++i) {
+      if (i->isInlineAsm()) continue;
+      if (i->mayLoadOrStore() || i->isTerminator()) {
+        access = &*i;
+        break;
+      }
+    }
+
+    bool ok = false;
+    if (src && access) {
+      SmallPtrSet<MachineInstr *, 16> seen;
+      if (access->isTerminator()) {
+        for (MachineBasicBlock::iterator t(access);
+             t != block->end() && !ok; ++t) {
+          ok = dependsOn(&*t, src, kMaxDepDepth, seen);
+        }
+      } else {
+        ok = dependsOn(access, src, kMaxDepDepth, seen);
+      }
+    }
+
+    if (!ok) {
+      NumDepsRepaired++;
+      if (DebugSpew) {
+        errs() << "Lost a dependency in " << MF.getName() << ": " << *marker;
+      }
+      BuildMI(*block, MachineBasicBlock::iterator(marker), marker->getDebugLoc(),
+              TII->get(TargetOpcode::INLINEASM))
+        .addExternalSymbol(lwsyncAsm(target))
+        .addImm(InlineAsm::Extra_HasSideEffects |
+                InlineAsm::Extra_MayLoad | InlineAsm::Extra_MayStore);
+    }
+    marker->eraseFromParent();
+  }
+
+  return !markers.empty();
+}
+
+}
+
+char CheckRMCDepsPass::ID = 0;
+static RegisterPass<CheckRMCDepsPass> X(
+  "check-rmc-deps",
+  "Check that RMC's dependencies survived instruction selection");
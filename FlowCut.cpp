@@ -0,0 +1,241 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// A polynomial time backend for visibility and push edges.
+//
+// Cutting every visibility edge with barriers is a weighted multicut
+// problem over the CFG, which is NP-hard in general (and which the SMT
+// backend solves exactly, but slowly). Cutting one edge, though, is
+// just a minimum s-t cut, which we can get from a max flow. So we cut
+// the edges one at a time, pushes first (since a sync cuts
+// everything), and make CFG edges that already have a strong enough
+// barrier free so that later edges can share them.
+//
+// Execution edges are left to the greedy algorithm, which knows about
+// control and data dependencies and which sees our barriers in cuts_.
+
+#include "sassert.h"
+#include "RMCInternal.h"
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <deque>
+#include <limits>
+
+#undef NDEBUG
+#include <assert.h>
+
+using namespace llvm;
+
+extern cl::opt<bool> DebugSpew;
+
+namespace {
+
+// Edmonds-Karp. The graphs are CFGs, so they are small and sparse.
+class FlowGraph {
+public:
+  typedef int64_t Cap;
+
+  explicit FlowGraph(int n) : adj_(n) {}
+
+  int addArc(int from, int to, Cap cap) {
+    int id = arcs_.size();
+    arcs_.push_back({to, cap});
+    adj_[from].push_back(id);
+    arcs_.push_back({from, 0});
+    adj_[to].push_back(id + 1);
+    return id;
+  }
+
+  Cap maxFlow(int s, int t) {
+    Cap total = 0;
+    std::vector<int> via;
+    while (findPath(s, t, via)) {
+      Cap push = std::numeric_limits<Cap>::max();
+      for (int v = t; v != s; v = arcs_[via[v] ^ 1].to) {
+        push = std::min(push, arcs_[via[v]].cap);
+      }
+      for (int v = t; v != s; v = arcs_[via[v] ^ 1].to) {
+        arcs_[via[v]].cap -= push;
+        arcs_[via[v] ^ 1].cap += push;
+      }
+      total += push;
+    }
+    return total;
+  }
+
+  // After maxFlow, an arc is in the min cut if its tail is reachable
+  // from the source in the residual graph and its head isn't.
+  bool inMinCut(int s, int arc) {
+    if (reach_.empty()) {
+      std::vector<int> via;
+      findPath(s, -1, via);
+      reach_.resize(adj_.size());
+      for (unsigned v = 0; v < adj_.size(); v++) reach_[v] = via[v] != -1;
+      reach_[s] = true;
+    }
+    return reach_[arcs_[arc ^ 1].to] && !reach_[arcs_[arc].to];
+  }
+
+private:
+  struct Arc { int to; Cap cap; };
+  std::vector<Arc> arcs_;
+  std::vector<std::vector<int>> adj_;
+  std::vector<bool> reach_;
+
+  // BFS in the residual graph, recording the arc used to get to each
+  // node in via (-1 for unreached).
+  bool findPath(int s, int t, std::vector<int> &via) {
+    via.assign(adj_.size(), -1);
+    std::deque<int> queue{s};
+    while (!queue.empty()) {
+      int u = queue.front();
+      queue.pop_front();
+      for (int id : adj_[u]) {
+        int v = arcs_[id].to;
+        if (arcs_[id].cap > 0 && via[v] == -1 && v != s) {
+          via[v] = id;
+          if (v == t) return true;
+          queue.push_back(v);
+        }
+      }
+    }
+    return false;
+  }
+};
+
+// Does a barrier of type have sufficient force for edge?
+bool barrierCuts(CutType type, const RMCEdge &edge) {
+  if (type == CutSync) return true;
+  if (edge.edgeType == PushEdge) return false;
+  if (type == CutLwsync) return true;
+  // dmb st only orders writes, but visibility edges only
+  // meaningfully affect writes.
+  return type == CutDmbSt && edge.src->type == ActionSimpleWrites;
+}
+
+}
+
+// A barrier type and its cost
+typedef std::pair<CutType, int> Barrier;
+
+// Pick the cheapest barrier that cuts a visibility or push edge.
+static Barrier barrierFor(const RMCEdge &edge,
+                          const TuningParams &params) {
+  if (edge.edgeType == PushEdge) return {CutSync, params.syncCost};
+  Barrier best{CutSync, params.syncCost};
+  if (paramEnabled(params.lwsyncCost) && params.lwsyncCost < best.second) {
+    best = {CutLwsync, params.lwsyncCost};
+  }
+  if (edge.src->type == ActionSimpleWrites &&
+      paramEnabled(params.dmbstCost) && params.dmbstCost < best.second) {
+    best = {CutDmbSt, params.dmbstCost};
+  }
+  return best;
+}
+
+void RealizeRMC::flowCutEdges() {
+  std::vector<RMCEdge> edges;
+  for (auto & edge : edges_) {
+    if (edge.edgeType != ExecutionEdge) edges.push_back(edge);
+  }
+  // Pushes first, since they can only be cut by syncs, which also cut
+  // everything else.
+  std::stable_sort(edges.begin(), edges.end(),
+                   [] (const RMCEdge &l, const RMCEdge &r) {
+                     return l.edgeType > r.edgeType;
+                   });
+
+  // Number the blocks. The source is the block the edge's source
+  // action finishes in, and every CFG edge into the destination goes
+  // to a separate sink node instead, so that edges from an action to
+  // itself (where the source and destination blocks are the same)
+  // still need to go around the loop.
+  DenseMap<BasicBlock *, int> ids;
+  std::vector<BasicBlock *> blocks;
+  for (auto & block : func_) {
+    ids[&block] = blocks.size();
+    blocks.push_back(&block);
+  }
+  int sink = blocks.size();
+  BasicBlock *entry = &func_.getEntryBlock();
+
+  // What we've put on each CFG edge so far. Like the SMT backend, we
+  // only ever put one barrier on an edge; a stronger one replaces a
+  // weaker one.
+  MapVector<EdgeKey, Barrier> placed;
+
+  for (auto & edge : edges) {
+    BasicBlock *src = edge.src->outBlock, *dst = edge.dst->bb;
+    // Nothing to do if the C11 orderings already there take care of it.
+    if (isRelAcqCut(edge)) continue;
+    auto kind = barrierFor(edge, params_);
+
+    FlowGraph graph(blocks.size() + 1);
+    std::vector<std::pair<EdgeKey, int>> arcs;
+    auto addArc = [&] (BasicBlock *from, BasicBlock *to) {
+      // Paths aren't allowed to go *through* the binding site, but they
+      // can start or end there. Dropping the arcs into it (other than
+      // the ones to the sink) is enough for that, since then the only
+      // way to be at it is to have started there.
+      // XXX: The path enumeration doesn't let paths start at the
+      // binding site at all; we are more conservative.
+      if (to == edge.bindSite && to != dst) return;
+      // Remote pushes already cut push edges out of them, so those
+      // CFG edges might as well not be there.
+      Action *a = bb2action_.lookup(from);
+      if (edge.edgeType == PushEdge && a && a->remotePush) return;
+      // Same for going into an action with a fence in it, unless that
+      // is where the path ends.
+      Action *toAction = bb2action_.lookup(to);
+      if (to != dst && toAction && toAction->fenceCuts(edge.edgeType)) return;
+      EdgeKey key = std::make_pair(from, to);
+      auto i = placed.find(key);
+      FlowGraph::Cap cap =
+        i != placed.end() && barrierCuts(i->second.first, edge) ? 0 :
+        (FlowGraph::Cap)kind.second * edgeWeight(from, to) + 1;
+      arcs.push_back({key, graph.addArc(ids[from],
+                                        to == dst ? sink : ids[to], cap)});
+    };
+    for (auto *block : blocks) {
+      // We consider all exits from a function to loop back to the
+      // start edge, just like the path enumeration does.
+      if (isa<ReturnInst>(block->getTerminator())) addArc(block, entry);
+      for (auto *succ : successors(block)) addArc(block, succ);
+    }
+
+    FlowGraph::Cap flow = graph.maxFlow(ids[src], sink);
+    if (DebugSpew) {
+      errs() << "Min cut for " << edge << ": " << flow << "\n";
+    }
+    for (auto & arc : arcs) {
+      if (!graph.inMinCut(ids[src], arc.second)) continue;
+      auto i = placed.find(arc.first);
+      if (i != placed.end() && barrierCuts(i->second.first, edge)) continue;
+      placed[arc.first] = kind;
+    }
+  }
+
+  // Now actually insert everything, and record it in the form that
+  // the greedy algorithm understands.
+  for (auto & entry : placed) {
+    BasicBlock *src, *dst;
+    unpack(src, dst) = entry.first;
+    CutType type = entry.second.first;
+    insertCut(EdgeCut(type, src, dst));
+    planCost_ += (int64_t)entry.second.second * edgeWeight(src, dst) + 1;
+
+    // This mirrors getCutInstr: if the source has multiple successors
+    // the barrier goes at the front of the destination, otherwise at
+    // the back of the source.
+    if (src->getTerminator()->getNumSuccessors() > 1) {
+      cuts_[dst] = BlockCut(type, true);
+    } else {
+      cuts_[src] = BlockCut(type, false);
+    }
+  }
+}
@@ -19,12 +19,15 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/InlineAsm.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/CFG.h>
 #include <llvm/IR/InstIterator.h>
+#include <llvm/IR/IRBuilder.h>
 
 #include <llvm/InitializePasses.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils.h>
 
 #include <llvm/ADT/ArrayRef.h>
@@ -35,6 +38,8 @@
 
 #include <llvm/IR/Dominators.h>
 #include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/CaptureTracking.h>
+#include <llvm/Analysis/ValueTracking.h>
 
 
 #include <llvm/Support/raw_ostream.h>
@@ -50,6 +55,10 @@
 #include <iostream>
 #include <map>
 #include <set>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <exception>
 
 #undef NDEBUG
 #include <assert.h>
@@ -97,7 +106,7 @@ raw_ostream& operator<<(raw_ostream& os, const ActionType& t) {
     SPEW_CASE(ActionPrePost);
     SPEW_CASE(ActionNop);
     SPEW_CASE(ActionComplex);
-    SPEW_CASE(ActionSimpleRead);
+    SPEW_CASE(ActionSimpleReads);
     SPEW_CASE(ActionSimpleWrites);
     SPEW_CASE(ActionSimpleRMW);
     SPEW_CASE(ActionGive);
@@ -153,6 +162,22 @@ bool isARM(RMCTarget target) {
   return target == TargetARM || target == TargetARMv8;
 }
 
+RMCTarget llvm::targetFromTriple(StringRef triple) {
+  if (triple.startswith("x86")) {
+    return TargetX86;
+  } else if (triple.startswith("aarch64")) {
+    return TargetARMv8;
+  } else if (triple.startswith("armv8")) {
+    return TargetARMv8;
+  } else if (triple.startswith("arm")) {
+    return TargetARM;
+  } else if (triple.startswith("powerpc")) {
+    return TargetPOWER;
+  }
+  assert(false && "not given a supported target");
+  std::terminate();
+}
+
 // Generate a unique str that we add to comments in our inline
 // assembly to keep llvm from getting clever and merging them.
 // This is awful.
@@ -194,23 +219,27 @@ Instruction *makeSync(Instruction *to_precede) {
   }
   return CallInst::Create(a, None, "", to_precede);
 }
-Instruction *makeLwsync(Instruction *to_precede) {
-  LLVMContext &C = to_precede->getContext();
-  FunctionType *f_ty = FunctionType::get(FunctionType::getVoidTy(C), false);
-  InlineAsm *a = nullptr;
+// The machine level dependency checker needs this too, so it gets
+// split out.
+const char *llvm::lwsyncAsm(RMCTarget target) {
   if (target == TargetARMv8) {
     // Because ARM strengthened their memory model to be "Other
     // multi-copy atomic", we can fake an lwsync (or at least the
     // properties of lwsync we require) by doing an dmb st; dmb ld!
     // This actually performs well too!
-    a = makeAsm(f_ty, "dmb ishld; dmb ishst // lwsync", "~{memory}", true);
+    return "dmb ishld; dmb ishst // lwsync";
   } else if (target == TargetARM) {
-    a = makeAsm(f_ty, "dmb ish // lwsync", "~{memory}", true);
+    return "dmb ish // lwsync";
   } else if (target == TargetPOWER) {
-    a = makeAsm(f_ty, "lwsync # lwsync", "~{memory}", true);
-  } else if (target == TargetX86) {
-    a = makeAsm(f_ty, "# lwsync", "~{memory}", true);
+    return "lwsync # lwsync";
+  } else {
+    return "# lwsync";
   }
+}
+Instruction *makeLwsync(Instruction *to_precede) {
+  LLVMContext &C = to_precede->getContext();
+  FunctionType *f_ty = FunctionType::get(FunctionType::getVoidTy(C), false);
+  InlineAsm *a = makeAsm(f_ty, lwsyncAsm(target), "~{memory}", true);
   return CallInst::Create(a, None, "", to_precede);
 }
 Instruction *makeDmbSt(Instruction *to_precede) {
@@ -276,15 +305,84 @@ Instruction *makeCtrlIsync(Value *v, Instruction *to_precede) {
   makeCtrl(v, i);
   return i;
 }
+// Copies get tagged with this metadata so that we (and anything else
+// that cares) can tell them apart from other inline assembly without
+// grovelling through the asm string. It's only good at the IR level:
+// instruction selection drops it, so it doesn't protect anything in
+// the backend.
+const char *kDepCopyMD = "rmc.dep";
 Instruction *makeCopy(Value *v, Instruction *to_precede) {
   Value *getRealValue(Value *v);
   FunctionType *f_ty = FunctionType::get(v->getType(), v->getType(), false);
   InlineAsm *a = makeAsm(f_ty, "# bs_copy", "=r,0", false); /* false?? */
-  return CallInst::Create(a, v,
-                          getRealValue(v)->getName() + ".__rmc_bs_copy",
-                          to_precede);
+  CallInst *copy = CallInst::Create(a, v,
+                                    getRealValue(v)->getName() +
+                                      ".__rmc_bs_copy",
+                                    to_precede);
+  copy->setMetadata(kDepCopyMD, MDNode::get(v->getContext(), None));
+  return copy;
+}
+// Make up a data dependency from v to the pointer in use. We compute
+// a zero from v with some assembly that llvm can't see through (so,
+// like a bs copy, it can't optimize it away) and add that to the
+// pointer.
+void makeDataDep(Value *v, Use *use) {
+  Value *getRealValue(Value *v);
+  Instruction *instr = cast<Instruction>(use->getUser());
+  Value *ptr = use->get();
+  LLVMContext &C = v->getContext();
+  const DataLayout &layout = instr->getModule()->getDataLayout();
+  Type *intTy = layout.getIntPtrType(ptr->getType());
+
+  Value *val = v->getType()->isPointerTy() ?
+    CastInst::Create(Instruction::PtrToInt, v, intTy, "", instr) :
+    CastInst::CreateIntegerCast(v, intTy, false, "", instr);
+  FunctionType *f_ty = FunctionType::get(intTy, intTy, false);
+  InlineAsm *a = nullptr;
+  if (isARM(target)) {
+    a = makeAsm(f_ty, "eor $0, $1, $1 // fake dep", "=r,r", false);
+  } else if (target == TargetPOWER) {
+    a = makeAsm(f_ty, "xor $0, $1, $1 # fake dep", "=r,r", false);
+  } else if (target == TargetX86) {
+    // Two operand, so tie the input to the output so that the zero
+    // at least looks like it came from v.
+    a = makeAsm(f_ty, "xor $0, $0 # fake dep", "=r,0", false);
+  }
+  Value *zero = CallInst::Create(a, val,
+                                 getRealValue(v)->getName() + ".__rmc_zero",
+                                 instr);
+
+  Type *bytePtrTy =
+    Type::getInt8PtrTy(C, ptr->getType()->getPointerAddressSpace());
+  Value *bytes = CastInst::CreatePointerCast(ptr, bytePtrTy, "", instr);
+  Value *moved = GetElementPtrInst::Create(Type::getInt8Ty(C), bytes, zero,
+                                           "", instr);
+  use->set(CastInst::CreatePointerCast(moved, ptr->getType(), "", instr));
+}
+// Make the value in use depend on v without a branch, by running it
+// through a conditional select on a comparison of v. Only on ARMv8.
+void makeCselDep(Value *v, Use *use) {
+  Value *getRealValue(Value *v);
+  Instruction *instr = cast<Instruction>(use->getUser());
+  Value *val = use->get();
+  FunctionType *f_ty =
+    FunctionType::get(val->getType(), {val->getType(), v->getType()}, false);
+  assert(target == TargetARMv8);
+  // Use the w registers for things that aren't 64 bits.
+  auto reg = [&] (int i, Value *x) {
+    bool wide = x->getType()->isPointerTy() ||
+      x->getType()->getIntegerBitWidth() == 64;
+    return "${" + std::to_string(i) + (wide ? "}" : ":w}");
+  };
+  std::string code =
+    "cmp " + reg(2, v) + ", " + reg(2, v) + "; " +
+    "csel " + reg(0, val) + ", " + reg(1, val) + ", " + reg(1, val) +
+    ", eq // csel";
+  InlineAsm *a = makeAsm(f_ty, code.c_str(), "=r,r,r,~{cc}", false);
+  use->set(CallInst::Create(a, {val, v},
+                            getRealValue(v)->getName() + ".__rmc_csel",
+                            instr));
 }
-// We also need to add a thing for fake data deps, which is more annoying.
 
 ///////////////////////////////////////////////////////////////////////////
 //// Some annoying LLVM version specific stuff
@@ -327,6 +425,17 @@ StringRef getStringArg(Value *v) {
   return str.drop_back();
 }
 
+// Labels normally get passed to our bogus functions as strings, but
+// if LowerMarkersPass has been at them, they live in metadata
+// instead, indexed by argument number.
+const char *kLabelsMD = "rmc.labels";
+StringRef getLabelArg(CallInst *call, unsigned i) {
+  if (MDNode *md = call->getMetadata(kLabelsMD)) {
+    return cast<MDString>(md->getOperand(i))->getString();
+  }
+  return getStringArg(call->getArgOperand(i));
+}
+
 Instruction *getNextInstr(Instruction *i) {
   BasicBlock::iterator I(*i);
   return ++I == i->getParent()->end() ? nullptr : &*I;
@@ -363,6 +472,25 @@ BasicBlock *getSingleSuccessor(BasicBlock *bb) {
   return term->getNumSuccessors() == 1 ? term->getSuccessor(0) : nullptr;
 }
 
+// Can we make up a data dependency from load into use? We need an
+// integer or pointer to compute with, and it needs to be available
+// where the use is. (Parameters are always available.)
+bool canAddDataDep(Value *load, Use *use, DominatorTree &domTree) {
+  Type *ty = load->getType(), *useTy = use->get()->getType();
+  if (!ty->isIntOrPtrTy() || !useTy->isIntOrPtrTy()) return false;
+  Instruction *instr = dyn_cast<Instruction>(load);
+  return !instr || domTree.dominates(instr, *use);
+}
+
+// Where to put a conditional select dependency into a write: the value
+// being stored, if it lives in a normal register, and the address
+// otherwise.
+Use *getCselTarget(Action &a) {
+  if (a.type != ActionSimpleWrites || !a.valueDep) return nullptr;
+  return a.valueDep->get()->getType()->isIntOrPtrTy() ?
+    a.valueDep : a.incomingDep;
+}
+
 }
 
 // Code to detect our inline asm things
@@ -378,6 +506,40 @@ bool isInstrInlineAsm(Instruction *i, const char *string) {
 }
 bool isInstrIsync(Instruction *i) { return isInstrInlineAsm(i, " isync #"); }
 bool isInstrBarrier(Instruction *i) { return isInstrInlineAsm(i, " barrier #");}
+// The comment at the end of the string is "sync" or "lwsync", after
+// either "#" or "//", depending on the target.
+bool isInstrSync(Instruction *i) {
+  return isInstrInlineAsm(i, "# sync #") || isInstrInlineAsm(i, "// sync #");
+}
+bool isInstrLwsync(Instruction *i) {
+  return isInstrInlineAsm(i, "# lwsync #") ||
+    isInstrInlineAsm(i, "// lwsync #");
+}
+
+cl::opt<bool> DepMarkers(
+  "rmc-dep-markers",
+  cl::desc("Mark the dependencies we use so that check-rmc-deps can "
+           "check them after instruction selection (for debugging only; "
+           "the markers are never removed otherwise)"));
+
+// Mark that access needs to depend on load, for the benefit of the
+// machine level checker. The marker is an empty asm that uses load
+// and sits right before access (which can be a terminator, for ctrl
+// deps).
+void markDep(Value *load, Instruction *access) {
+  Value *getRealValue(Value *v);
+  if (!DepMarkers || !load->getType()->isIntOrPtrTy()) return;
+  Instruction *prev = access->getPrevNode();
+  if (isInstrInlineAsm(prev, kDepMarker) &&
+      getRealValue(cast<CallInst>(prev)->getArgOperand(0)) == load) {
+    return;
+  }
+  LLVMContext &C = load->getContext();
+  FunctionType *f_ty =
+    FunctionType::get(FunctionType::getVoidTy(C), load->getType(), false);
+  InlineAsm *a = makeAsm(f_ty, kDepMarker, "r", true);
+  CallInst::Create(a, load, "", access);
+}
 
 void deleteRegisterCall(Instruction *i) {
   // Delete a bogus registration call. There might be uses if we didn't mem2reg.
@@ -443,14 +605,58 @@ TinyPtrVector<Action *> RealizeRMC::collectEdges(StringRef name) {
   return matches;
 }
 
-void RealizeRMC::processEdge(CallInst *call) {
+bool isEdgeRegisterCall(Instruction *i) {
+  CallInst *call = dyn_cast<CallInst>(i);
+  Function *target = call ? call->getCalledFunction() : nullptr;
+  return target && target->getName() == "__rmc_edge_register";
+}
+
+// Are two edge registrations copies of the same one? rmc-core.h
+// gives each one in the source a unique dummy argument, so two edges
+// with the same labels written in different places don't count.
+// (Registrations without one, from older headers, are compared
+// without it.)
+bool sameEdgeRegister(CallInst *c1, CallInst *c2) {
+  if (c1->arg_size() > 4 && c2->arg_size() > 4 &&
+      c1->getArgOperand(4) != c2->getArgOperand(4)) {
+    return false;
+  }
+  return c1->getOperand(0) == c2->getOperand(0) &&
+    c1->getOperand(3) == c2->getOperand(3) &&
+    getLabelArg(c1, 1) == getLabelArg(c2, 1) &&
+    getLabelArg(c1, 2) == getLabelArg(c2, 2);
+}
+
+// If the optimizer has duplicated an edge registration that binds in
+// the function (by unrolling a loop, say), each copy is responsible
+// for the copies of the actions that it is the closest dominating
+// copy of. Actions that no copy dominates get all of them, to be safe.
+TinyPtrVector<Action *> RealizeRMC::bindingClones(
+    CallInst *call, ArrayRef<CallInst *> clones,
+    const TinyPtrVector<Action *> &actions) {
+  TinyPtrVector<Action *> matches;
+  for (auto *a : actions) {
+    CallInst *closest = nullptr;
+    for (auto *clone : clones) {
+      if (!domTree_.dominates(clone->getParent(), a->bb)) continue;
+      if (!closest ||
+          domTree_.dominates(closest->getParent(), clone->getParent())) {
+        closest = clone;
+      }
+    }
+    if (!closest || closest == call) matches.push_back(a);
+  }
+  return matches;
+}
+
+void RealizeRMC::processEdge(CallInst *call, ArrayRef<CallInst *> clones) {
   // Pull out what the operands have to be.
   // We just assert if something is wrong, which is not great UX.
   uint64_t val = cast<ConstantInt>(call->getOperand(0))
     ->getValue().getLimitedValue();
   RMCEdgeType edgeType = (RMCEdgeType)val; // a bit dubious
-  StringRef srcName = getStringArg(call->getOperand(1));
-  StringRef dstName = getStringArg(call->getOperand(2));
+  StringRef srcName = getLabelArg(call, 1);
+  StringRef dstName = getLabelArg(call, 2);
   uint64_t bindHere = cast<ConstantInt>(call->getOperand(3))
     ->getValue().getLimitedValue();
 
@@ -460,6 +666,18 @@ void RealizeRMC::processEdge(CallInst *call) {
   // otherwise it is nullptr to represent outside the function.
   BasicBlock *bindSite = bindHere ? call->getParent() : nullptr;
 
+  // Edges bound outside the function order actions across calls, so
+  // they need to go between every copy of the actions, but a copy of
+  // an edge bound in the function only binds its own copies.
+  SmallVector<CallInst *, 2> copies;
+  for (auto *other : clones) {
+    if (sameEdgeRegister(call, other)) copies.push_back(other);
+  }
+  if (bindSite && copies.size() > 1) {
+    srcs = bindingClones(call, copies, srcs);
+    dsts = bindingClones(call, copies, dsts);
+  }
+
   for (auto src : srcs) {
     for (auto dst : dsts) {
       registerEdge(edges_, edgeType, bindSite, src, dst);
@@ -502,7 +720,40 @@ bool RealizeRMC::processPush(CallInst *call) {
   }
 }
 
+// Remote pushes come in pairs: a cheap side that is just a compiler
+// barrier and an expensive side that calls rmc_remote_push_trigger(),
+// which needs to make every other running thread execute a full
+// barrier (using membarrier or signals, say). Between them, they act
+// like a push at both places. So both sides cut any push edge that
+// goes through them, but nothing else, since the cheap side does
+// nothing to order anything on its own.
+const char *kRemotePushTrigger = "rmc_remote_push_trigger";
+bool RealizeRMC::processRemotePush(CallInst *call, bool expensive) {
+  Action *a = bb2action_[call->getParent()]; // Just as dubious.
+  // Like with pushes, leave calls that aren't in actions alone.
+  if (!a) return false;
+
+  if (expensive) {
+    LLVMContext &C = call->getContext();
+    FunctionCallee trigger = call->getModule()->getOrInsertFunction(
+      kRemotePushTrigger, FunctionType::get(Type::getVoidTy(C), false));
+    CallInst::Create(trigger, "", call);
+  } else {
+    makeBarrier(call);
+  }
+  a->remotePush = true;
+  return true;
+}
+
 void RealizeRMC::findEdges() {
+  // Find all the edge registrations up front, so that we can tell
+  // when one has been duplicated. We hold off on deleting them until
+  // we are done.
+  std::vector<CallInst *> edgeCalls;
+  for (auto & i : instructions(func_)) {
+    if (isEdgeRegisterCall(&i)) edgeCalls.push_back(cast<CallInst>(&i));
+  }
+
   for (inst_iterator is = inst_begin(func_), ie = inst_end(func_); is != ie;) {
     // Grab the instruction and advance the iterator at the start, since
     // we might delete the instruction.
@@ -516,15 +767,24 @@ void RealizeRMC::findEdges() {
     // the calls.
     if (!target) continue;
     if (target->getName() == "__rmc_edge_register") {
-      processEdge(call);
+      processEdge(call, edgeCalls);
+      continue;
     } else if (target->getName() == "__rmc_push") {
       if (!processPush(call)) continue;
+    } else if (target->getName() == "__rmc_push_cheap" ||
+               target->getName() == "__rmc_push_expensive") {
+      bool expensive = target->getName() == "__rmc_push_expensive";
+      if (!processRemotePush(call, expensive)) continue;
     } else {
       continue;
     }
 
     deleteRegisterCall(i);
   }
+
+  for (auto *call : edgeCalls) {
+    deleteRegisterCall(call);
+  }
 }
 
 // XXX: document this scheme more?
@@ -569,92 +829,231 @@ void handleTransfer(Action &info, CallInst *call) {
                        ii, value);
 }
 
+// Does an access already have (at least) acquire or release
+// ordering? We only trust system scope orderings.
+bool orderingIs(AtomicOrdering order, SyncScope::ID scope,
+                AtomicOrdering want) {
+  return scope == SyncScope::System && isAtLeastOrStrongerThan(order, want);
+}
 template <typename T>
-bool actionIsSC(T *i) {
-  return i->getOrdering() == AtomicOrdering::SequentiallyConsistent &&
-    i->getSyncScopeID() == SyncScope::System;
+bool actionIs(T *i, AtomicOrdering want) {
+  return orderingIs(i->getOrdering(), i->getSyncScopeID(), want);
+}
+bool actionIs(AtomicCmpXchgInst *i, AtomicOrdering want) {
+  // A failed cmpxchg is just a load, so it only needs to match for
+  // acquire.
+  return orderingIs(i->getSuccessOrdering(), i->getSyncScopeID(), want) &&
+    (want != AtomicOrdering::Acquire ||
+     orderingIs(i->getFailureOrdering(), i->getSyncScopeID(), want));
+}
+
+// Can a call touch memory that another thread could see? Calls that
+// don't touch memory at all (critically, llvm.dbg.*) can't, and
+// neither can calls that only touch memory through their arguments
+// when those all point to memory only this thread can see (like
+// llvm.lifetime.* or a memset on a local that doesn't escape).
+// We only count locals: TLS variables get their addresses handed to
+// other threads all the time (see Parking::getCurrent()).
+bool isThreadLocal(const Value *ptr) {
+  const Value *obj = getUnderlyingObject(ptr);
+  return isa<AllocaInst>(obj) &&
+    !PointerMayBeCaptured(obj, /*ReturnCaptures=*/true,
+                          /*StoreCaptures=*/true);
+}
+bool touchesSharedMemory(CallInst *call) {
+  if (call->doesNotAccessMemory()) return false;
+  if (!call->onlyAccessesArgMemory()) return true;
+  for (Value *arg : call->args()) {
+    if (arg->getType()->isPointerTy() && !isThreadLocal(arg)) return true;
+  }
+  return false;
 }
-bool actionIsSC(AtomicCmpXchgInst *i) {
-  return i->getSuccessOrdering() == AtomicOrdering::SequentiallyConsistent &&
-    i->getFailureOrdering() == AtomicOrdering::SequentiallyConsistent &&
-    i->getSyncScopeID() == SyncScope::System;
+
+// Find all the blocks of a multi-block action, if they make a nice
+// region: every block we can get to from the start (without going
+// past the out block) needs to be able to get to the out block
+// (without going back through the start). Otherwise something jumps
+// out of the middle of the action (or it never finishes) and we
+// can't say much about it.
+bool findActionBlocks(const Action &info,
+                      SmallVectorImpl<BasicBlock *> &blocks) {
+  blocks.clear();
+  if (info.bb == info.outBlock) {
+    blocks.push_back(info.bb);
+    return true;
+  }
+
+  SmallPtrSet<BasicBlock *, 8> canFinish;
+  SmallVector<BasicBlock *, 8> worklist{info.outBlock};
+  canFinish.insert(info.outBlock);
+  while (!worklist.empty()) {
+    BasicBlock *block = worklist.pop_back_val();
+    if (block == info.bb) continue;
+    for (BasicBlock *pred : predecessors(block)) {
+      if (canFinish.insert(pred).second) worklist.push_back(pred);
+    }
+  }
+
+  SmallPtrSet<BasicBlock *, 8> seen;
+  worklist.push_back(info.bb);
+  seen.insert(info.bb);
+  while (!worklist.empty()) {
+    BasicBlock *block = worklist.pop_back_val();
+    if (!canFinish.count(block)) {
+      blocks.clear();
+      return false;
+    }
+    blocks.push_back(block);
+    if (block == info.outBlock) continue;
+    for (BasicBlock *succ : successors(block)) {
+      if (seen.insert(succ).second) worklist.push_back(succ);
+    }
+  }
+  return true;
 }
 
 void analyzeAction(Action &info) {
   // Don't analyze the dummy pre/post actions!
   if (info.type == ActionPrePost) return;
 
-  // We search through info.outBlock instead of info.bb because if the
+  // If the action is a nice region, we look at all of its blocks.
+  // If not, we only search through info.outBlock, because if the
   // action is a multiblock LTAKE, the __rmc_transfer_ call will be in
   // the final block. If it doesn't end up being a transfer, then we
-  // call any action where the parts don't match "complex".
-
-  bool allSC = true;
-
-  Instruction *soleLoad = nullptr;
-  for (auto & i : *info.outBlock) {
-    if (auto *load = dyn_cast<LoadInst>(&i)) {
-      ++info.loads;
-      soleLoad = &i;
-      allSC &= actionIsSC(load);
-    } else if (auto *store = dyn_cast<StoreInst>(&i)) {
-      ++info.stores;
-      allSC &= actionIsSC(store);
-    } else if (auto *call = dyn_cast<CallInst>(&i)) {
-      // If this is a transfer, mark it as such
-      if (Function *target = call->getCalledFunction()) {
-        // This is *really* silly. We declare appropriate __rmc_transfer
-        // functions as needed at use sites, but if this happens
-        // inside of namespaces, the name gets mangled. So we look
-        // through the whole string, not just the prefix. Sigh.
-        if (target->getName().find("__rmc_transfer_") != StringRef::npos) {
-          handleTransfer(info, call);
-          return;
+  // call it "complex".
+  SmallVector<BasicBlock *, 4> blocks;
+  bool isRegion = findActionBlocks(info, blocks);
+  if (!isRegion) blocks.push_back(info.outBlock);
+  bool multiBlock = info.bb != info.outBlock;
+
+  // Track whether the C11 orderings already on the accesses give us
+  // acquire or release semantics for the whole action.
+  bool allAcquire = true, allRelease = true;
+  bool hasSync = false, hasLwsync = false;
+  auto noteOrdering = [&] (auto *i) {
+    allAcquire &= actionIs(i, AtomicOrdering::Acquire);
+    allRelease &= actionIs(i, AtomicOrdering::Release);
+  };
+
+  // Accesses to memory that no other thread can see (locals that we
+  // copy into or out of, mostly) don't count for anything.
+  Instruction *soleLoad = nullptr, *soleStore = nullptr;
+  for (BasicBlock *block : blocks) {
+    for (auto & i : *block) {
+      if (auto *load = dyn_cast<LoadInst>(&i)) {
+        if (isThreadLocal(load->getPointerOperand())) continue;
+        ++info.loads;
+        soleLoad = &i;
+        noteOrdering(load);
+      } else if (auto *store = dyn_cast<StoreInst>(&i)) {
+        if (isThreadLocal(store->getPointerOperand())) continue;
+        ++info.stores;
+        soleStore = &i;
+        noteOrdering(store);
+      } else if (auto *mem = dyn_cast<MemIntrinsic>(&i)) {
+        // A memcpy/memmove/memset is a bunch of plain reads of its
+        // source and writes to its destination. They can't carry
+        // dependencies that we know how to use, though, so they never
+        // become the sole load or store.
+        if (auto *copy = dyn_cast<MemTransferInst>(mem)) {
+          if (!isThreadLocal(copy->getRawSource())) ++info.loads;
         }
+        if (!isThreadLocal(mem->getRawDest())) ++info.stores;
+        info.bulk = true;
+        allAcquire = allRelease = false;
+      } else if (auto *call = dyn_cast<CallInst>(&i)) {
+        // If this is a transfer, mark it as such
+        if (Function *target = call->getCalledFunction()) {
+          // This is *really* silly. We declare appropriate __rmc_transfer
+          // functions as needed at use sites, but if this happens
+          // inside of namespaces, the name gets mangled. So we look
+          // through the whole string, not just the prefix. Sigh.
+          if (target->getName().find("__rmc_transfer_") != StringRef::npos) {
+            handleTransfer(info, call);
+            return;
+          }
+        }
+        // Our own barriers don't touch memory, but they are fences.
+        if (isInstrSync(call)) {
+          hasSync = true;
+          continue;
+        } else if (isInstrLwsync(call)) {
+          hasLwsync = true;
+          continue;
+        }
+        if (touchesSharedMemory(call)) {
+          ++info.calls;
+        }
+        allAcquire = allRelease = false;
+      } else if (auto *fence = dyn_cast<FenceInst>(&i)) {
+        // Fences don't access memory, so they don't change what the
+        // action does, only how it is ordered. On all of our targets a
+        // seq_cst fence is a sync and an acq_rel one is (at least) an
+        // lwsync; weaker ones we just ignore.
+        if (fence->getSyncScopeID() == SyncScope::System) {
+          if (fence->getOrdering() == AtomicOrdering::SequentiallyConsistent) {
+            hasSync = true;
+          } else if (fence->getOrdering() == AtomicOrdering::AcquireRelease) {
+            hasLwsync = true;
+          }
+        }
+      } else if (auto *rmw = dyn_cast<AtomicRMWInst>(&i)) {
+        ++info.RMWs;
+        soleLoad = &i;
+        noteOrdering(rmw);
+      } else if (auto *cas = dyn_cast<AtomicCmpXchgInst>(&i)) {
+        ++info.RMWs;
+        soleLoad = &i;
+        noteOrdering(cas);
       }
-      // Don't count functions that don't access memory
-      // (for example, critically, llvm.dbg.* intrinsics)
-      if (!(call->getCalledFunction() &&
-            call->getCalledFunction()->doesNotAccessMemory())) {
-        ++info.calls;
-      }
-      allSC = false;
-    // What else counts as a call? I'm counting fences I guess.
-    } else if (isa<FenceInst>(i)) {
-      ++info.calls;
-      allSC = false;
-    } else if (auto *rmw = dyn_cast<AtomicRMWInst>(&i)) {
-      ++info.RMWs;
-      soleLoad = &i;
-      allSC &= actionIsSC(rmw);
-    } else if (auto *cas = dyn_cast<AtomicCmpXchgInst>(&i)) {
-      ++info.RMWs;
-      soleLoad = &i;
-      allSC &= actionIsSC(cas);
-    }
-  }
-
-  // Now that we know it isn't a transfer,
-  // if the action has multiple basic blocks, call it Complex
-  if (info.outBlock != info.bb) {
+    }
+  }
+
+  // Now that we know it isn't a transfer, if the action has multiple
+  // basic blocks that don't make a nice region, call it Complex
+  if (!isRegion) {
     info.type = ActionComplex;
     return;
   }
 
-  // Now that we're past all the return cases, we can safely call it
-  // allSC if it is.
-  info.allSC = allSC;
+  // Now that we're past all the return cases, we can safely record
+  // what we found. We don't know where in a multi-block action a
+  // fence is, so those don't get to use them.
+  info.blocks.insert(blocks.begin(), blocks.end());
+  info.allAcquire = allAcquire;
+  info.allRelease = allRelease;
+  if (!multiBlock) {
+    info.hasSync = hasSync;
+    info.hasLwsync = hasLwsync;
+  }
 
   // Try to characterize what this action does.
   // These categories might not be the best.
-  if (info.loads == 1 && info.stores+info.calls+info.RMWs == 0) {
-    info.outgoingDep = soleLoad;
-    info.incomingDep = &soleLoad->getOperandUse(0);
-    info.type = ActionSimpleRead;
+  // We only look for dependencies in single block actions, since in a
+  // loop a dependency on the sole load or store only covers one
+  // iteration of it.
+  if (info.loads >= 1 && info.stores+info.calls+info.RMWs == 0) {
+    if (info.loads == 1 && soleLoad && !multiBlock) {
+      info.outgoingDep = soleLoad;
+      info.incomingDep = &soleLoad->getOperandUse(0);
+    }
+    info.type = ActionSimpleReads;
   } else if (info.stores >= 1 && info.loads+info.calls+info.RMWs == 0) {
+    if (info.stores == 1 && soleStore && !multiBlock) {
+      info.incomingDep = &soleStore->getOperandUse(1);
+      info.valueDep = &soleStore->getOperandUse(0);
+    }
     info.type = ActionSimpleWrites;
-  } else if (info.RMWs == 1 && info.stores+info.loads+info.calls == 0) {
+  } else if (info.RMWs == 1 && info.stores+info.loads+info.calls == 0 &&
+             !multiBlock) {
     info.outgoingDep = soleLoad;
+    // Both sorts of RMW have the pointer first. Only an atomicrmw is
+    // sure to write, though, so a dependency into the new value of a
+    // cmpxchg doesn't order anything if it fails.
+    info.incomingDep = &soleLoad->getOperandUse(0);
+    if (isa<AtomicRMWInst>(soleLoad)) {
+      info.valueDep = &soleLoad->getOperandUse(1);
+    }
     info.type = ActionSimpleRMW;
   } else if (info.RMWs+info.stores+info.loads+info.calls == 0) {
     info.type = ActionNop;
@@ -686,12 +1085,23 @@ void RealizeRMC::findActions() {
   actions_.reserve(3 * registrations.size());
   numNormalActions_ = registrations.size();
   for (auto reg : registrations) {
+    StringRef name = getLabelArg(reg, 0);
+
     // FIXME: this scheme only works if we've run mem2reg. Otherwise we
     // need to chase through the alloca...
-    assert(reg->hasOneUse());
-    Instruction *close = cast<Instruction>(*reg->user_begin());
-
-    StringRef name = getStringArg(reg->getOperand(0));
+    // The calls are convergent, which lets the optimizer copy whole
+    // actions (by inlining or unrolling) but not split a register from
+    // its close. Copies of an action each get their own register and
+    // close, so they are just more actions with the same name. If
+    // something got split up anyways, we are stuck.
+    CallInst *close = reg->hasOneUse() ?
+      dyn_cast<CallInst>(*reg->user_begin()) : nullptr;
+    if (!close || !close->getCalledFunction() ||
+        close->getCalledFunction()->getName() != "__rmc_action_close") {
+      errs() << "Error: action '" << name << "' in function '"
+             << func_.getName() << "' does not have exactly one close\n";
+      rmc_error();
+    }
 
     // Now that we have found the start and the end of the action,
     // split the action into its own (group of) basic blocks so that
@@ -808,7 +1218,9 @@ Value *getBSCopyValue(Value *v) {
   if (!call) return nullptr;
   InlineAsm *iasm = dyn_cast<InlineAsm>(call->getCalledOperand());
   if (!iasm) return nullptr;
-  // This is kind of dubious
+  if (call->getMetadata(kDepCopyMD)) return call->getOperand(0);
+  // Untagged copies can come from bitcode built by an older version
+  // of us. This is kind of dubious.
   return iasm->getAsmString().find("# bs_copy #") != StringRef::npos ?
     call->getOperand(0) : nullptr;
 }
@@ -852,17 +1264,34 @@ void hideUses(Instruction *instr, User *skip) {
   }
 }
 
-//
-void enforceBranchOn(BasicBlock *next, ICmpInst *icmp, int idx) {
-  if (!icmp) return;
+// Keep a control dependency found by branchesOn from being optimized
+// away. chain is what computes the branch condition from the load.
+void enforceBranchOn(BasicBlock *next, ArrayRef<Instruction *> chain) {
+  if (chain.empty()) return;
   // In order to keep LLVM from optimizing our stuff away we
   // insert dummy copies of the operands and a compiler barrier in the
-  // target.
-  hideOperands(icmp);
+  // target. For terminators we only hide the condition, since the
+  // rest of the operands are blocks and case values. For the arithmetic
+  // in between, hiding the values coming from the load is enough; by
+  // the time we run, anything that could fold with a constant already
+  // has.
+  for (auto *instr : chain) {
+    if (isa<BranchInst>(instr) || isa<SwitchInst>(instr)) {
+      hideOperand(instr, 0);
+    } else if (isa<CmpInst>(instr)) {
+      hideOperands(instr);
+    } else {
+      for (unsigned i = 0; i < instr->getNumOperands(); i++) {
+        if (!isa<Constant>(instr->getOperand(i))) hideOperand(instr, i);
+      }
+    }
+  }
   Instruction *front = &*next->getFirstInsertionPt();
   if (!isInstrBarrier(front)) makeBarrier(front);
 }
 
+bool isAddrDepLossy(Value *v);
+
 void enforceAddrDeps(Use *use, std::vector<Instruction *> &trail) {
   Instruction *end = cast<Instruction>(use->getUser());
   //errs() << "enforcing for: " << *end << "\n";
@@ -871,6 +1300,14 @@ void enforceAddrDeps(Use *use, std::vector<Instruction *> &trail) {
     Instruction *next = is+1 != ie ? *(is+1) : end;
     hideUses(*is, next);
   }
+  // And hide what goes into the steps that could fold it all away
+  // (see isAddrDepLossy).
+  for (auto *instr : trail) {
+    if (!isAddrDepLossy(instr)) continue;
+    for (unsigned i = 0; i < instr->getNumOperands(); i++) {
+      if (!isa<Constant>(instr->getOperand(i))) hideOperand(instr, i);
+    }
+  }
 }
 
 // Find everything that transitively depends on some value
@@ -896,14 +1333,58 @@ UseSet findTransitiveUses(Value *v) {
   return seen;
 }
 
-// We trace through GEP, BitCast, IntToPtr.
+// We trace through GEP, BitCast, IntToPtr, and the sort of integer
+// arithmetic that pointer tagging does.
 // TODO: less heavily restrict what we use?
+//
+// "Safe" operations are ones that can't make the result stop
+// depending on their input, so we can leave them alone once we have
+// decided to rely on a dependency through them. Adding, subtracting
+// and xoring a constant can't lose anything, and neither can casts
+// that keep all the bits.
 bool isAddrDepSafe(Value *v) {
+  if (BinaryOperator *binop = dyn_cast<BinaryOperator>(v)) {
+    Constant *c = dyn_cast<Constant>(binop->getOperand(1));
+    if (!c) c = dyn_cast<Constant>(binop->getOperand(0));
+    if (!c || isa<ConstantExpr>(c)) return false;
+    switch (binop->getOpcode()) {
+    case Instruction::Xor:
+    case Instruction::Add:
+    case Instruction::Sub:
+      return true;
+    default:
+      return false;
+    }
+  }
   return isa<GetElementPtrInst>(v) || isa<BitCastInst>(v) ||
-    isa<SExtInst>(v) || isa<IntToPtrInst>(v) ||
+    isa<SExtInst>(v) || isa<ZExtInst>(v) ||
+    isa<IntToPtrInst>(v) || isa<PtrToIntInst>(v) ||
     isa<LoadInst>(v);
 }
 
+// Masking and truncating (what pointer tagging does) can carry a
+// dependency too, but only as long as the optimizer doesn't notice
+// that a chain of them throws away all the bits that came from the
+// load: "(x & 1) & 2" folds to 0. So we trace through them, but hide
+// their operands when we rely on them. (We don't even try with masks
+// that obviously lose everything.)
+bool isAddrDepLossy(Value *v) {
+  if (isa<TruncInst>(v)) return true;
+  BinaryOperator *binop = dyn_cast<BinaryOperator>(v);
+  if (!binop) return false;
+  Constant *c = dyn_cast<Constant>(binop->getOperand(1));
+  if (!c) c = dyn_cast<Constant>(binop->getOperand(0));
+  if (!c || isa<ConstantExpr>(c)) return false;
+  switch (binop->getOpcode()) {
+  case Instruction::And:
+    return !c->isNullValue();
+  case Instruction::Or:
+    return !c->isAllOnesValue();
+  default:
+    return false;
+  }
+}
+
 // A different approach for hiding address deps, in which we find all
 // transitive uses and hide operands to uses that could cause trouble.
 // (As opposed to hiding *all* uses off the main path of a trail.)
@@ -934,40 +1415,65 @@ void enforceAddrDeps(Value *src) {
 // FIXME: reorganize the namespace stuff?. Or put this in the class.
 namespace llvm {
 
-// Look for control dependencies on a read.
+// How many operations deep we look for a load in a branch condition
+const int kMaxCtrlDepth = 4;
+
+// Is v computed from load by some chain of compares, casts, selects
+// and arithmetic? If so, add the instructions on the way to chain.
+// We pretty heavily restrict what operations we handle here. Some
+// would just be wrong (like call).
+bool computedFrom(Value *v, Value *load,
+                  SmallVectorImpl<Instruction *> &chain, int depth) {
+  v = getRealValue(v);
+  if (v == load) return true;
+  Instruction *instr = dyn_cast<Instruction>(v);
+  if (!instr || depth == 0) return false;
+  if (!(isa<CmpInst>(instr) || isa<CastInst>(instr) ||
+        isa<BinaryOperator>(instr) || isa<SelectInst>(instr))) {
+    return false;
+  }
+  for (auto *op : instr->operand_values()) {
+    if (computedFrom(op, load, chain, depth - 1)) {
+      chain.push_back(instr);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Look for control dependencies on a read. If chainOut is given, it
+// gets what needs to be protected from the optimizer to keep the
+// dependency (see enforceBranchOn).
 bool branchesOn(BasicBlock *bb, Value *load,
-                ICmpInst **icmpOut, int *outIdx) {
+                SmallVectorImpl<Instruction *> *chainOut) {
   // XXX: make this platform configured; on some platforms maybe an
   // atomic cmpxchg does /not/ behave like it branches on the old value
   if (isa<AtomicCmpXchgInst>(load) || isa<AtomicRMWInst>(load)) {
-    if (icmpOut) *icmpOut = nullptr;
-    if (outIdx) *outIdx = 0;
+    if (chainOut) chainOut->clear();
     return true;
   }
 
   // TODO: we should be able to follow values through phi nodes,
   // since we are path dependent anyways.
-  BranchInst *br = dyn_cast<BranchInst>(bb->getTerminator());
-  if (!br || !br->isConditional()) return false;
-  // TODO: We only check one level of things. Check deeper?
-
-  // We pretty heavily restrict what operations we handle here.
-  // Some would just be wrong (like call), but really icmp is
-  // the main one, so. Probably we should be able to also
-  // pick through casts and wideness changes.
-  ICmpInst *icmp = dyn_cast<ICmpInst>(br->getCondition());
-  if (!icmp) return false;
-  int idx = 0;
-  for (auto v : icmp->operand_values()) {
-    if (getRealValue(v) == load) {
-      if (icmpOut) *icmpOut = icmp;
-      if (outIdx) *outIdx = idx;
-      return true;
-    }
-    ++idx;
+  Instruction *term = bb->getTerminator();
+  Value *cond;
+  if (BranchInst *br = dyn_cast<BranchInst>(term)) {
+    if (!br->isConditional()) return false;
+    cond = br->getCondition();
+  } else if (SwitchInst *sw = dyn_cast<SwitchInst>(term)) {
+    cond = sw->getCondition();
+  } else {
+    return false;
   }
 
-  return false;
+  SmallVector<Instruction *, 4> chain;
+  if (!computedFrom(cond, load, chain, kMaxCtrlDepth)) return false;
+  // If there is nothing between the load and the terminator, or if it
+  // is a switch (which LLVM likes to turn into other things), we
+  // need to hide the condition from the optimizer at the terminator.
+  if (chain.empty() || isa<SwitchInst>(term)) chain.push_back(term);
+  if (chainOut) chainOut->assign(chain.begin(), chain.end());
+  return true;
 }
 
 typedef SmallPtrSet<Value *, 4> PendingPhis;
@@ -1003,15 +1509,22 @@ bool addrDepsOnSearch(Value *pointer, Value *load,
 
   // I wish we weren't recursive. Maybe we should restrict how we
   // trace through GEPs?
-  if (isa<GetElementPtrInst>(instr) || isa<BitCastInst>(instr) ||
-      isa<SExtInst>(instr) || isa<IntToPtrInst>(instr) ||
-      isa<LoadInst>(instr)) {
+  if (isAddrDepSafe(instr) || isAddrDepLossy(instr)) {
     for (auto v : instr->operand_values()) {
       if (addrDepsOnSearch(v, load, reachable, phis, trails)) {
         return extend_trails(true);
       }
     }
   }
+  // A select is like a phi: both of the values it picks between need
+  // to depend on the load. (LLVM is free to turn it into a branch, so
+  // depending on the condition isn't good enough.)
+  if (SelectInst *select = dyn_cast<SelectInst>(instr)) {
+    bool succ =
+      addrDepsOnSearch(select->getTrueValue(), load, reachable, phis, trails) &&
+      addrDepsOnSearch(select->getFalseValue(), load, reachable, phis, trails);
+    return extend_trails(succ);
+  }
   // We need to trace down *every* phi node path, except ones
   // that weren't reachable anyways.
   if (PHINode *phi = dyn_cast<PHINode>(instr)) {
@@ -1075,15 +1588,58 @@ bool addrDepsOn(Use *use, Value *load,
                           reachable_p, phis, trails);
 }
 
+// Does anything coming into an action (its address or, for writes,
+// the value it writes) depend on load? Returns the use that does.
+Use *dataDepsOn(Action &a, Value *load,
+                PathCache *cache, BasicBlock *bindSite, PathID path,
+                std::vector<std::vector<Instruction *> > *trails) {
+  for (Use *use : {a.incomingDep, a.valueDep}) {
+    if (trails) trails->clear();
+    if (use && addrDepsOn(use, load, cache, bindSite, path, trails)) {
+      return use;
+    }
+  }
+  return nullptr;
+}
+
 }
 
 
 ////////////// non-SMT specific compilation
 
+// Is an edge already cut by acquire and release orderings that were
+// on the accesses to begin with? This follows the same rules as
+// makeRelAcqCut in the SMT backend.
+bool RealizeRMC::isRelAcqCut(const RMCEdge &edge) {
+  const Action &src = *edge.src, &dst = *edge.dst;
+  RMCEdgeType type = edge.edgeType;
+  if (type == PushEdge) return false;
+  bool srcReads =
+    src.type == ActionSimpleReads || src.type == ActionSimpleRMW;
+
+  // W1 -v-> W/RW2, and more on ARMv8 -- W/RW2 = rel
+  if ((src.type == ActionSimpleWrites || params_.relAbuse) &&
+      (dst.type == ActionSimpleWrites ||
+       (dst.type == ActionSimpleRMW && type == VisibilityEdge)) &&
+      dst.allRelease) {
+    return true;
+  }
+  // R/RW1 -x-> * -- R/RW1 = acq
+  if (type == ExecutionEdge && srcReads && src.allAcquire) return true;
+  // R/RW1 -v-> W/RW2 -- both
+  if (!params_.relAbuse && srcReads &&
+      (dst.type == ActionSimpleWrites || dst.type == ActionSimpleRMW) &&
+      src.allAcquire && dst.allRelease) {
+    return true;
+  }
+  return false;
+}
+
 CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
                                   PathID pathid,
                                   bool enforceSoft,
-                                  bool justCheckCtrl) {
+                                  bool justCheckCtrl,
+                                  DepUses *uses) {
   Path path = pc_.extractPath(pathid);
   if (path.size() <= 1) return HardCut;
 
@@ -1095,6 +1651,17 @@ CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
     bool isFront = i == path.begin(), isBack = i == e-1;
     BasicBlock *bb = *i;
 
+    // Remote pushes cut push edges that go through them
+    if (edge.edgeType == PushEdge && !isBack) {
+      Action *a = bb2action_.lookup(bb);
+      if (a && a->remotePush) return HardCut;
+    }
+    // And fences in actions cut edges that go all the way through them
+    if (!isFront && !isBack) {
+      Action *a = bb2action_.lookup(bb);
+      if (a && a->fenceCuts(edge.edgeType)) return HardCut;
+    }
+
     auto cut_i = cuts_.find(bb);
     if (cut_i != cuts_.end()) {
       const BlockCut &cut = cut_i->second;
@@ -1108,6 +1675,12 @@ CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
         if (cut.type == CutLwsync && edge.edgeType < PushEdge) {
           return HardCut;
         }
+        // dmb st cuts visibility edges out of writes (the min-cut
+        // backend puts these in)
+        if (cut.type == CutDmbSt && edge.edgeType == VisibilityEdge &&
+            edge.src->type == ActionSimpleWrites) {
+          return HardCut;
+        }
         // ctrlisync cuts
         if (edge.edgeType == ExecutionEdge &&
             cut.type == CutCtrlIsync &&
@@ -1130,13 +1703,16 @@ CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
     if (hasSoftCut) continue;
 
     // Is there a branch on the load?
-    int idx;
-    ICmpInst *icmp;
-    hasSoftCut = branchesOn(bb, outgoingDep, &icmp, &idx);
+    SmallVector<Instruction *, 4> chain;
+    hasSoftCut = branchesOn(bb, outgoingDep, &chain);
 
+    BasicBlock *next = *(i+1);
+    if (hasSoftCut && uses) {
+      uses->ctrl.insert(std::make_tuple(outgoingDep, bb, next));
+    }
     if (hasSoftCut && enforceSoft) {
-      BasicBlock *next = *(i+1);
-      enforceBranchOn(next, icmp, idx);
+      enforceBranchOn(next, chain);
+      markDep(outgoingDep, bb->getTerminator());
     }
   }
 
@@ -1144,20 +1720,29 @@ CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
 
   // Try a data cut
   // See if we have a data dep in a very basic way.
-  // FIXME: Should be able to handle writes also!
+  // A dependency into a write only gives us execution order, though.
   std::vector<std::vector<Instruction *> > trails;
   auto trailp = enforceSoft && !kUseTransitiveHiding ? &trails : nullptr;
-  if (edge.src->outgoingDep && edge.dst->incomingDep &&
-      addrDepsOn(edge.dst->incomingDep, edge.src->outgoingDep,
-                 &pc_, edge.bindSite, pathid, trailp)) {
+  bool depCuts = edge.edgeType == ExecutionEdge ||
+    !(edge.dst->type == ActionSimpleWrites ||
+      edge.dst->type == ActionSimpleRMW);
+  Use *dep = nullptr;
+  if (depCuts && edge.src->outgoingDep &&
+      (dep = dataDepsOn(*edge.dst, edge.src->outgoingDep,
+                        &pc_, edge.bindSite, pathid, trailp))) {
+    if (uses) {
+      uses->data.insert(std::make_tuple(edge.bindSite, edge.src->bb,
+                                        edge.dst->bb, pathid));
+    }
     if (enforceSoft) {
       if (kUseTransitiveHiding) {
         enforceAddrDeps(edge.src->outgoingDep);
       } else {
         for (auto & trail : trails) {
-          enforceAddrDeps(edge.dst->incomingDep, trail);
+          enforceAddrDeps(dep, trail);
         }
       }
+      markDep(edge.src->outgoingDep, cast<Instruction>(dep->getUser()));
     }
     return DataCut;
   }
@@ -1166,8 +1751,10 @@ CutStrength RealizeRMC::isPathCut(const RMCEdge &edge,
 }
 
 CutStrength RealizeRMC::isEdgeCut(const RMCEdge &edge,
-                                  bool enforceSoft, bool justCheckCtrl) {
+                                  bool enforceSoft, bool justCheckCtrl,
+                                  DepUses *uses) {
   CutStrength strength = HardCut;
+  if (isRelAcqCut(edge)) return strength;
 
   PathCache::SkipSet skip;
   if (edge.bindSite) skip.insert(edge.bindSite);
@@ -1176,35 +1763,59 @@ CutStrength RealizeRMC::isEdgeCut(const RMCEdge &edge,
   //pc_.dumpPaths(paths);
   for (auto & path : paths) {
     CutStrength pathStrength = isPathCut(edge, path,
-                                         enforceSoft, justCheckCtrl);
+                                         enforceSoft, justCheckCtrl, uses);
     if (pathStrength < strength) strength = pathStrength;
   }
 
   return strength;
 }
 
-bool RealizeRMC::isCut(const RMCEdge &edge) {
+// Charge for the dependencies in uses that we haven't already paid
+// for, the same way the SMT cost function does: control deps by the
+// weight of the CFG edge they are on, and data deps by the weight of
+// the edge into the destination, once per path.
+void RealizeRMC::chargeDeps(const DepUses &uses) {
+  for (auto & use : uses.ctrl) {
+    if (!usedDeps_.ctrl.insert(use).second) continue;
+    planCost_ += std::max(params_.useCtrlCost, 0) *
+      edgeWeight(std::get<1>(use), std::get<2>(use));
+  }
+  for (auto & use : uses.data) {
+    if (!usedDeps_.data.insert(use).second) continue;
+    planCost_ += std::max(params_.useDataCost, 0) *
+      greedyWeight(std::get<2>(use));
+  }
+}
+
+bool RealizeRMC::isCut(const RMCEdge &edge, bool enforce) {
   RMCEdge selfEdge = RMCEdge{edge.edgeType, edge.src, edge.src, edge.bindSite};
 
-  switch (isEdgeCut(edge)) {
+  DepUses uses;
+  switch (isEdgeCut(edge, false, false, &uses)) {
   case HardCut: return true;
   case NoCut: return false;
   case DataCut:
     // We need to make sure we have a cut from src->src but it *isn't*
     // enough to just check ctrl!
-    if (isEdgeCut(selfEdge, false, false)
+    if (isEdgeCut(selfEdge, false, false, &uses)
         > NoCut) {
-      isEdgeCut(edge, true, false);
-      isEdgeCut(selfEdge, true, false);
+      if (enforce) {
+        isEdgeCut(edge, true, false);
+        isEdgeCut(selfEdge, true, false);
+      }
+      chargeDeps(uses);
       return true;
     } else {
       return false;
     }
   case SoftCut:
-    if (isEdgeCut(selfEdge, false, true)
+    if (isEdgeCut(selfEdge, false, true, &uses)
         > NoCut) {
-      isEdgeCut(edge, true, true);
-      isEdgeCut(selfEdge, true, true);
+      if (enforce) {
+        isEdgeCut(edge, true, true);
+        isEdgeCut(selfEdge, true, true);
+      }
+      chargeDeps(uses);
       return true;
     } else {
       return false;
@@ -1213,24 +1824,106 @@ bool RealizeRMC::isCut(const RMCEdge &edge) {
   }
 }
 
-void RealizeRMC::cutEdge(RMCEdge &edge) {
-  if (isCut(edge)) return;
+void RealizeRMC::cutEdge(const GreedyStep &step, bool apply) {
+  const RMCEdge &edge = step.edge;
+  if (isCut(edge, apply)) return;
 
-  // As a first pass, we just insert lwsyncs at the start of the destination.
+  // We insert lwsyncs at the start of the destination, or at the start
+  // of the block following the source if asked and there is one.
   // (Or syncs if it is a push edge)
   BasicBlock *bb = edge.dst->bb;
-  Instruction *i_point = &*bb->getFirstInsertionPt();
-  if (edge.edgeType == PushEdge) {
-    makeSync(i_point);
-  } else {
-    makeLwsync(i_point);
+  if (step.atSrc) {
+    if (BasicBlock *after = getSingleSuccessor(edge.src->outBlock)) {
+      bb = after;
+    }
   }
+  bool isPush = edge.edgeType == PushEdge;
+  if (apply) {
+    Instruction *i_point = &*bb->getFirstInsertionPt();
+    if (isPush) {
+      makeSync(i_point);
+    } else {
+      makeLwsync(i_point);
+    }
+  }
+  // Charge for it the same way the SMT cost function would.
+  int cost = isPush || !paramEnabled(params_.lwsyncCost) ?
+    params_.syncCost : params_.lwsyncCost;
+  planCost_ += (int64_t)cost * greedyWeight(bb) + 1;
   // XXX: we need to make sure we can't ever fail to track a cut at one side
   // of a block because we inserted one at the other! Argh!
-  cuts_[bb] = BlockCut(CutLwsync, true);
+  cuts_[bb] = BlockCut(isPush ? CutSync : CutLwsync, true);
 }
 
-void RealizeRMC::cutEdges() {
+#if USE_Z3
+cl::opt<bool> CompareSMT(
+  "rmc-compare-smt",
+  cl::desc("Report the cost of the non-SMT output against the SMT optimum"));
+#else
+const bool CompareSMT = false;
+#endif
+
+// The weight of a cut on a CFG edge (or of a block, if dst is null).
+// If we are going to compare against the SMT backend, we use its
+// weights so the costs mean the same thing.
+int RealizeRMC::edgeWeight(BasicBlock *src, BasicBlock *dst) {
+  if (greedyCaps_.empty()) {
+    greedyCaps_ = CompareSMT ?
+      computeCapacities(loopInfo_, func_) :
+      estimateCapacities(loopInfo_, func_);
+  }
+  return greedyCaps_.lookup(std::make_pair(src, dst));
+}
+
+// The weight of a cut at the front of a block: the capacity of the
+// edge into it, if there is just one, and of the block otherwise.
+int RealizeRMC::greedyWeight(BasicBlock *bb) {
+  BasicBlock *pred = bb->getSinglePredecessor();
+  return edgeWeight(pred ? pred : bb, pred ? bb : nullptr);
+}
+
+// Run the greedy algorithm over a plan without modifying the
+// function and return the cost of what it would do. Anything already
+// in cuts_ (from the min-cut backend) is taken as a given.
+int64_t RealizeRMC::planCost(const GreedyPlan &plan) {
+  auto savedCuts = cuts_;
+  auto savedDeps = usedDeps_;
+  int64_t savedCost = planCost_;
+  planCost_ = 0;
+  for (auto & step : plan) {
+    cutEdge(step, false);
+  }
+  int64_t cost = planCost_;
+  cuts_ = std::move(savedCuts);
+  usedDeps_ = std::move(savedDeps);
+  planCost_ = savedCost;
+  return cost;
+}
+
+cl::opt<unsigned> GreedySearchIters(
+  "rmc-greedy-search-iters",
+  cl::desc("How many plans the greedy algorithm tries"),
+  cl::init(200));
+// Off by default, since with a time limit what we come up with depends
+// on how loaded the machine is.
+cl::opt<unsigned> GreedySearchTime(
+  "rmc-greedy-search-ms",
+  cl::desc("Time limit, in milliseconds, for the greedy plan search "
+           "(0 for none)"),
+  cl::init(0));
+// After this many tries without finding anything better, start over
+// from a fresh random plan.
+const unsigned kGreedyRestartInterval = 20;
+
+// The greedy algorithm is sensitive to the order it processes edges
+// in and to where it puts barriers, so we do an iterated local search
+// over plans, scoring each one with the SMT cost function. Moves
+// either pull a random edge forward to a random earlier position or
+// flip which side of an edge its barrier goes on; when we get stuck we
+// restart from a random shuffle. We always seed the RNG the same way
+// so that compiling the same thing twice gives the same code (unless
+// -rmc-greedy-search-ms is given and we run into it, that is).
+RealizeRMC::GreedyPlan RealizeRMC::searchGreedyPlan() {
   // Sort the edges by edge type so we do push, vis, exec, which
   // results in better codegen with the crappy greedy algorithm.
   // Should maybe do some better sorting to do things like cutting
@@ -1239,12 +1932,106 @@ void RealizeRMC::cutEdges() {
   auto cmp = [&] (const RMCEdge &l, const RMCEdge &r) {
     return l.edgeType > r.edgeType;
   };
-  std::stable_sort(edges_.begin(), edges_.end(), cmp);
+  // (We sort a copy, since the SMT backend also works from edges_.)
+  std::vector<RMCEdge> edges = edges_;
+  std::stable_sort(edges.begin(), edges.end(), cmp);
+  // That is our starting point for searching for a better plan.
+  GreedyPlan best;
+  for (auto & edge : edges) {
+    best.push_back({edge, false});
+  }
+  if (best.size() <= 1 || GreedySearchIters == 0) return best;
+
+  auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(GreedySearchTime);
+  std::mt19937 rng(0);
+  auto pick = [&] (size_t lo, size_t hi) {
+    return std::uniform_int_distribution<size_t>(lo, hi)(rng);
+  };
+
+  GreedyPlan cur = best;
+  int64_t bestCost = planCost(best), curCost = bestCost;
+  unsigned sinceImproved = 0;
+
+  for (unsigned iter = 0; iter < GreedySearchIters && bestCost > 0; iter++) {
+    if (GreedySearchTime && std::chrono::steady_clock::now() > deadline) {
+      break;
+    }
+
+    GreedyPlan cand = cur;
+    if (sinceImproved >= kGreedyRestartInterval) {
+      std::shuffle(cand.begin(), cand.end(), rng);
+      for (auto & step : cand) step.atSrc = pick(0, 1);
+      sinceImproved = 0;
+      curCost = INT64_MAX;
+    } else if (pick(0, 1)) {
+      cand[pick(0, cand.size() - 1)].atSrc ^= true;
+    } else {
+      size_t from = pick(1, cand.size() - 1);
+      size_t to = pick(0, from - 1);
+      std::rotate(cand.begin() + to, cand.begin() + from,
+                  cand.begin() + from + 1);
+    }
+
+    int64_t cost = planCost(cand);
+    if (cost <= curCost) {
+      cur = std::move(cand);
+      curCost = cost;
+    }
+    if (cost < bestCost) {
+      best = cur;
+      bestCost = cost;
+      sinceImproved = 0;
+    } else {
+      sinceImproved++;
+    }
+  }
+
+  if (DebugSpew) {
+    errs() << "Greedy plan search: " << bestCost << "\n";
+  }
+  return best;
+}
+
+void RealizeRMC::cutEdges() {
+  GreedyPlan plan = searchGreedyPlan();
 
   // Now actually process the edges
-  for (auto & edge : edges_) {
-    cutEdge(edge);
+  for (auto & step : plan) {
+    cutEdge(step);
+  }
+}
+
+// Figure out what barriers the greedy algorithm would insert, as CFG
+// edge cuts, without changing anything. The SMT backend uses this to
+// get a head start.
+std::vector<EdgeCut> RealizeRMC::greedyCuts() {
+  GreedyPlan plan = searchGreedyPlan();
+  auto savedCuts = cuts_;
+  auto savedDeps = usedDeps_;
+  int64_t savedCost = planCost_;
+  for (auto & step : plan) {
+    cutEdge(step, false);
+  }
+
+  std::vector<EdgeCut> cuts;
+  for (auto & entry : cuts_) {
+    BasicBlock *bb = entry.first;
+    const BlockCut &cut = entry.second;
+    // The greedy algorithm only puts barriers at the fronts of blocks
+    // with a single predecessor.
+    BasicBlock *pred = bb->getSinglePredecessor();
+    if (!cut.isFront || !pred) continue;
+    // No lwsync means that makeLwsync gives us a full sync
+    CutType type = cut.type == CutLwsync &&
+      !paramEnabled(params_.lwsyncCost) ? CutSync : cut.type;
+    cuts.push_back(EdgeCut(type, pred, bb));
   }
+
+  cuts_ = std::move(savedCuts);
+  usedDeps_ = std::move(savedDeps);
+  planCost_ = savedCost;
+  return cuts;
 }
 
 ////////////// SMT specific compilation
@@ -1273,8 +2060,8 @@ void removeUselessEdges(std::vector<Action> &actions) {
       if (!(st == ActionNop || dt == ActionNop ||
             /* R->R has same force as execution, and we made execution
              * versions of all the vis edges. */
-            (st == ActionSimpleRead && dt == ActionSimpleRead) ||
-            (st == ActionSimpleWrites && dt == ActionSimpleRead))) {
+            (st == ActionSimpleReads && dt == ActionSimpleReads) ||
+            (st == ActionSimpleWrites && dt == ActionSimpleReads))) {
         src.transEdges[VisibilityEdge].insert(std::move(entry));
       }
     }
@@ -1334,12 +2121,16 @@ AtomicOrdering strengthenOrder(AtomicOrdering order, AtomicOrdering strength) {
   return strength;
 }
 
+// Accesses to thread local memory didn't count when we analyzed the
+// action, so leave them alone here too.
 void strengthenBlockOrders(BasicBlock *block, AtomicOrdering strength) {
   for (auto & i : *block) {
     if (StoreInst *store = dyn_cast<StoreInst>(&i)) {
+      if (isThreadLocal(store->getPointerOperand())) continue;
       store->setAtomic(strengthenOrder(store->getOrdering(), strength));
     }
     if (LoadInst *load = dyn_cast<LoadInst>(&i)) {
+      if (isThreadLocal(load->getPointerOperand())) continue;
       load->setAtomic(strengthenOrder(load->getOrdering(), strength));
     }
     if (AtomicRMWInst *rmw = dyn_cast<AtomicRMWInst>(&i)) {
@@ -1385,10 +2176,11 @@ void RealizeRMC::insertCut(const EdgeCut &cut) {
     break;
   case CutCtrl:
   {
-    int idx; ICmpInst *icmp;
-    bool branches = branchesOn(cut.src, cut.read, &icmp, &idx);
+    SmallVector<Instruction *, 4> chain;
+    bool branches = branchesOn(cut.src, cut.read, &chain);
     if (branches) {
-      enforceBranchOn(cut.dst, icmp, idx);
+      enforceBranchOn(cut.dst, chain);
+      markDep(cut.read, cut.src->getTerminator());
     } else {
       makeCtrl(cut.read, getCutInstr(cut));
     }
@@ -1398,10 +2190,9 @@ void RealizeRMC::insertCut(const EdgeCut &cut) {
   {
     std::vector<std::vector<Instruction *> > trails;
     auto trailp = !kUseTransitiveHiding ? &trails : nullptr;
-    Use *end = bb2action_[cut.dst]->incomingDep;
-    bool deps = addrDepsOn(end, cut.read, &pc_,
-                           cut.bindSite, cut.path, trailp);
-    assert_(deps);
+    Use *end = dataDepsOn(*bb2action_[cut.dst], cut.read, &pc_,
+                          cut.bindSite, cut.path, trailp);
+    assert_(end);
     if (kUseTransitiveHiding) {
       enforceAddrDeps(cut.read);
     } else {
@@ -1409,8 +2200,15 @@ void RealizeRMC::insertCut(const EdgeCut &cut) {
         enforceAddrDeps(end, trail);
       }
     }
+    markDep(cut.read, cast<Instruction>(end->getUser()));
     break;
   }
+  case CutAddData:
+    makeDataDep(cut.read, bb2action_[cut.dst]->incomingDep);
+    break;
+  case CutCsel:
+    makeCselDep(cut.read, getCselTarget(*bb2action_[cut.dst]));
+    break;
   case CutRelease:
     strengthenBlockOrders(cut.src, AtomicOrdering::Release);
     break;
@@ -1446,6 +2244,11 @@ void RealizeRMC::fixupBlockNames() {
   }
 }
 
+cl::opt<bool> UseMinCut(
+  "rmc-use-mincut",
+  cl::desc("Use min-cuts to place barriers for visibility edges "
+           "when not using SMT"));
+
 bool RealizeRMC::run() {
   findActions();
   findEdges();
@@ -1482,7 +2285,14 @@ bool RealizeRMC::run() {
   }
 
   if (!useSMT_) {
+    // Get the optimal cost now, before we start changing things.
+    if (CompareSMT) smtAnalyze();
+    if (UseMinCut) flowCutEdges();
     cutEdges();
+    if (CompareSMT) {
+      errs() << "RMC cost: " << func_.getName() << " " << planCost_ <<
+        " smt " << smtCost_ << "\n";
+    }
   } else {
     auto cuts = smtAnalyze();
     //errs() << "Applying SMT results:\n";
@@ -1506,6 +2316,63 @@ cl::opt<bool> UseSMT("rmc-use-smt",
 const bool UseSMT = false;
 #endif
 
+// With -rmc-single-threaded-clones, every function with actions gets
+// a copy tagged with this attribute, which gets used when there is
+// only one thread and so doesn't need any ordering at all. We just
+// get rid of the RMC markers in it.
+const char *kSingleThreadedAttr = "rmc-single-threaded";
+
+// Is this a call to one of the functions that the RMC pass is
+// supposed to make go away?
+static bool isRMCMarker(Instruction &i) {
+  CallInst *call = dyn_cast<CallInst>(&i);
+  Function *target = call ? call->getCalledFunction() : nullptr;
+  if (!target) return false;
+  StringRef name = target->getName();
+  return name == "__rmc_action_register" || name == "__rmc_action_close" ||
+    name == "__rmc_edge_register" || name == "__rmc_push" ||
+    name == "__rmc_push_cheap" || name == "__rmc_push_expensive" ||
+    name.find("__rmc_transfer_") != StringRef::npos;
+}
+
+bool stripRMC(Function &F) {
+  std::vector<CallInst *> calls;
+  for (auto & i : instructions(F)) {
+    if (isRMCMarker(i)) calls.push_back(cast<CallInst>(&i));
+  }
+  for (auto *call : calls) {
+    // Transfers pass their value through; nothing else has a result
+    // that matters.
+    Value *value = call->getCalledFunction()->getName().find(
+      "__rmc_transfer_") != StringRef::npos ?
+      call->getArgOperand(0) : UndefValue::get(call->getType());
+    call->replaceAllUsesWith(value);
+    call->eraseFromParent();
+  }
+  return !calls.empty();
+}
+
+// Functions that we have realized get tagged with this. With LTO the
+// pass can see a function twice: once when its file is compiled and
+// again in the link time optimizer. The attribute makes it into the
+// bitcode, so the second time around we can leave the function alone
+// unless something with actions has been inlined into it since.
+// We only look for action and edge registrations, since realizing a
+// function always gets rid of those; pushes that aren't in an action
+// get left behind on purpose and don't mean anything is left to do.
+const char *kRealizedAttr = "rmc-realized";
+static bool hasUnrealizedActions(Function &F) {
+  for (auto & i : instructions(F)) {
+    CallInst *call = dyn_cast<CallInst>(&i);
+    Function *target = call ? call->getCalledFunction() : nullptr;
+    if (target && (target->getName() == "__rmc_action_register" ||
+                   target->getName() == "__rmc_edge_register")) {
+      return true;
+    }
+  }
+  return false;
+}
+
 // The actual pass. It has a bogus setup routine and otherwise
 // calls out to RealizeRMC.
 class RealizeRMCPass : public FunctionPass {
@@ -1517,23 +2384,19 @@ public:
   virtual bool doInitialization(Module &M) override {
     // Pull the platform out of the target triple and then sort of bogusly
     // stick it in a global variable
-    std::string triple = M.getTargetTriple();
-    if (triple.find("x86") == 0) {
-      target = TargetX86;
-    } else if (triple.find("aarch64") == 0) {
-      target = TargetARMv8;
-    } else if (triple.find("armv8") == 0) {
-      target = TargetARMv8;
-    } else if (triple.find("arm") == 0) {
-      target = TargetARM;
-    } else if (triple.find("powerpc") == 0) {
-      target = TargetPOWER;
-    } else {
-      assert(false && "not given a supported target");
-    }
+    target = targetFromTriple(M.getTargetTriple());
+    return false;
+  }
+  virtual bool doFinalization(Module &M) override {
+    releaseSmtState();
     return false;
   }
   virtual bool runOnFunction(Function &F) override {
+    if (F.hasFnAttribute(kSingleThreadedAttr)) return stripRMC(F);
+    if (F.hasFnAttribute(kRealizedAttr) && !hasUnrealizedActions(F)) {
+      return false;
+    }
+
     // We, for unfortunate reasons that we should fix, depend on having
     // proper names for basic blocks. Make sure we do.
     bool discard = keepValueNames(F);
@@ -1545,6 +2408,7 @@ public:
     bool res = rmc.run();
 
     restoreValueNames(F, discard);
+    if (res) F.addFnAttr(kRealizedAttr);
     return res;
   }
 
@@ -1582,9 +2446,22 @@ struct RMCInit {
 cl::opt<bool> DoRMC("rmc-pass",
                     cl::desc("Enable the RMC pass in the pass manager"));
 
-static void registerRMCPass(const PassManagerBuilder &,
+cl::opt<bool> RMCAtLinkTime(
+  "rmc-at-link-time",
+  cl::desc("When compiling for LTO, leave the RMC markers in the bitcode "
+           "and do RMC in the link time optimizer"));
+
+static void registerRMCPass(const PassManagerBuilder &Builder,
                             legacy::PassManagerBase &PM) {
-  if (DoRMC) { PM.add(new RealizeRMCPass()); }
+  if (!DoRMC) return;
+  // Everything we need is in the markers, which survive being written
+  // out as bitcode, so when compiling for LTO we can wait until after
+  // inlining across files. In the ThinLTO backend this is where we
+  // get run, since it does the normal function pipeline again.
+  if (RMCAtLinkTime && (Builder.PrepareForLTO || Builder.PrepareForThinLTO)) {
+    return;
+  }
+  PM.add(new RealizeRMCPass());
 }
 // LoopOptimizerEnd seems to be a fairly reasonable place to stick
 // this.  We want it after inlining and some basic optimizations, but
@@ -1597,9 +2474,9 @@ static RegisterStandardPasses
     RegisterRMC(PassManagerBuilder::EP_LoopOptimizerEnd,
                 registerRMCPass);
 
-// A very simple pass that deletes all of the dummy copies that RMC
-// inserted.  My hope is that this can be safely inserted at the very
-// end of compilation in order to remove the register allocation and
+// A very simple pass that deletes dummy copies that RMC inserted.
+// My hope was that this could be safely inserted at the very end of
+// compilation in order to remove the register allocation and
 // instruction selection penalties from the dummy copies.
 //
 // Is this guaranteed to not get broken by post-IR peepholing and the
@@ -1607,6 +2484,22 @@ static RegisterStandardPasses
 // Nope: on POWER with -O=3, it optimizes out the deps in dep1 and dep5
 // Actually, for POWER, it gets broken by pre-IR optimizations that
 // are enabled in a POWER specific way as part of the backend...
+//
+// -rmc-cleanup-safe-copies (which wins if both are given) instead
+// only deletes the copies that can't be carrying a dependency: copies
+// of constants (which enforceBranchOn makes when it hides both sides
+// of a compare) and copies of other copies. Those are the ones that
+// cost the most, anyways, since they keep us from using immediate
+// forms. The backend sees the rest as inline assembly. That isn't
+// something codegen promises to preserve dependencies through, though
+// (and the rmc.dep tag doesn't survive instruction selection), so
+// treat removing copies at -O3 as unsafe either way.
+cl::opt<bool> DoCleanupCopies("rmc-cleanup-copies",
+                              cl::desc("Enable the RMC copy cleanup phase"));
+cl::opt<bool> DoCleanupSafeCopies(
+  "rmc-cleanup-safe-copies",
+  cl::desc("Only clean up RMC copies that can't be protecting a dependency"));
+
 class CleanupCopiesPass : public FunctionPass {
 public:
   static char ID;
@@ -1617,7 +2510,9 @@ public:
     bool changed = false;
     for (auto is = BB.begin(), ie = BB.end(); is != ie; ) {
       Instruction *i = &*is++;
-      if (Value *v = getBSCopyValue(i)) {
+      Value *v = getBSCopyValue(i);
+      if (v &&
+          (!DoCleanupSafeCopies || isa<Constant>(v) || getBSCopyValue(v))) {
         i->replaceAllUsesWith(v);
         i->eraseFromParent();
         changed = true;
@@ -1643,17 +2538,233 @@ public:
 char CleanupCopiesPass::ID = 0;
 RegisterPass<CleanupCopiesPass> Y("cleanup-copies", "Remove some RMC crud at the end");
 
-cl::opt<bool> DoCleanupCopies("rmc-cleanup-copies",
-                              cl::desc("Enable the RMC copy cleanup phase"));
-
 static void registerCleanupPass(const PassManagerBuilder &,
                                legacy::PassManagerBase &PM) {
-  if (DoCleanupCopies) { PM.add(new CleanupCopiesPass()); }
+  if (DoCleanupCopies || DoCleanupSafeCopies) {
+    PM.add(new CleanupCopiesPass());
+  }
 }
 static RegisterStandardPasses
     RegisterCleanup(PassManagerBuilder::EP_OptimizerLast,
                     registerCleanupPass);
 
+// The full LTO pipeline doesn't have a loop optimizer end or an
+// optimizer last, so do RMC and the cleanup at the very end. Anything
+// that was already done at compile time gets skipped.
+static void registerLTOPasses(const PassManagerBuilder &,
+                              legacy::PassManagerBase &PM) {
+  if (!DoRMC) return;
+  PM.add(new RealizeRMCPass());
+  if (DoCleanupCopies || DoCleanupSafeCopies) {
+    PM.add(new CleanupCopiesPass());
+  }
+}
+static RegisterStandardPasses
+    RegisterLTO(PassManagerBuilder::EP_FullLinkTimeOptimizationLast,
+                registerLTOPasses);
+
+
+// An early pass that moves the labels passed to our bogus functions
+// into metadata, so that the strings don't hang around in the module
+// (and wind up in the object file). While we are at it, we tell LLVM
+// that edge registrations don't touch any memory it can see, since
+// all that matters about them is what block they are in.
+//
+// Action registers and closes are another story: they *need* to be
+// optimization barriers, since memory accesses moving across them
+// would change what is in the action. Clang plugins can't add
+// builtins or intrinsics, so these stay calls.
+class LowerMarkersPass : public ModulePass {
+public:
+  static char ID;
+  LowerMarkersPass() : ModulePass(ID) { }
+  ~LowerMarkersPass() { }
+
+  bool lowerCalls(Module &M, StringRef name, ArrayRef<unsigned> labelArgs,
+                  SmallPtrSetImpl<GlobalVariable *> &strings) {
+    Function *func = M.getFunction(name);
+    if (!func) return false;
+    LLVMContext &C = M.getContext();
+    bool changed = false;
+    for (User *user : func->users()) {
+      CallInst *call = dyn_cast<CallInst>(user);
+      if (!call || call->getCalledFunction() != func ||
+          call->getMetadata(kLabelsMD)) {
+        continue;
+      }
+      SmallVector<Metadata *, 4> labels(call->arg_size(), nullptr);
+      for (unsigned i : labelArgs) {
+        Value *arg = call->getArgOperand(i);
+        labels[i] = MDString::get(C, getStringArg(arg));
+        strings.insert(cast<GlobalVariable>(arg->stripPointerCasts()));
+        call->setArgOperand(
+          i, ConstantPointerNull::get(cast<PointerType>(arg->getType())));
+      }
+      call->setMetadata(kLabelsMD, MDTuple::get(C, labels));
+      changed = true;
+    }
+    return changed;
+  }
+
+  virtual bool runOnModule(Module &M) override {
+    SmallPtrSet<GlobalVariable *, 16> strings;
+    bool changed = lowerCalls(M, "__rmc_action_register", {0}, strings);
+    changed |= lowerCalls(M, "__rmc_edge_register", {1, 2}, strings);
+
+    if (Function *func = M.getFunction("__rmc_edge_register")) {
+      func->addFnAttr(Attribute::InaccessibleMemOnly);
+      func->addFnAttr(Attribute::NoUnwind);
+      changed = true;
+    }
+
+    for (auto *string : strings) {
+      string->removeDeadConstantUsers();
+      if (string->use_empty() && string->hasLocalLinkage()) {
+        string->eraseFromParent();
+      }
+    }
+    return changed;
+  }
+};
+
+char LowerMarkersPass::ID = 0;
+RegisterPass<LowerMarkersPass> W("lower-rmc-markers",
+                                 "Move RMC labels into metadata");
+
+cl::opt<bool> DoLowerMarkers(
+  "rmc-lower-markers",
+  cl::desc("Move RMC labels into metadata before optimizing"));
+
+// These two module passes only need to happen once, before the
+// bitcode gets written out, so we skip them in the ThinLTO backend.
+static void registerLowerMarkersPass(const PassManagerBuilder &Builder,
+                                     legacy::PassManagerBase &PM) {
+  if (DoRMC && DoLowerMarkers && !Builder.PerformThinLTO) {
+    PM.add(new LowerMarkersPass());
+  }
+}
+static RegisterStandardPasses
+    RegisterLowerMarkers(PassManagerBuilder::EP_ModuleOptimizerEarly,
+                         registerLowerMarkersPass);
+
+
+// Make single-threaded versions of functions with actions, and have
+// the originals call them when __rmc_multithreaded isn't set. The
+// flag is defined in rmc-core.h. It starts out set, so the clones only
+// get used once the program calls rmc_assume_single_threaded(), and
+// it has to call rmc_become_multithreaded() before any other threads
+// start running RMC code. We do this early so that the
+// copies get optimized without our markers in the way; anything with
+// markers that gets inlined into them later gets stripped by the main
+// pass.
+class VersionRMCPass : public ModulePass {
+public:
+  static char ID;
+  VersionRMCPass() : ModulePass(ID) { }
+  ~VersionRMCPass() { }
+
+  static bool hasActions(Function &F) {
+    for (auto & i : instructions(F)) {
+      CallInst *call = dyn_cast<CallInst>(&i);
+      Function *target = call ? call->getCalledFunction() : nullptr;
+      if (target && target->getName() == "__rmc_action_register") {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // We forward all of the arguments, so we can't handle varargs or
+  // arguments that live in the caller's frame.
+  static bool canVersion(Function &F) {
+    if (F.isDeclaration() || F.isVarArg() ||
+        F.hasFnAttribute(kSingleThreadedAttr)) {
+      return false;
+    }
+    for (auto & arg : F.args()) {
+      if (arg.hasByValAttr() || arg.hasInAllocaAttr() ||
+          arg.hasPreallocatedAttr() || arg.hasSwiftErrorAttr()) {
+        return false;
+      }
+    }
+    return hasActions(F);
+  }
+
+  void addDispatch(Function &F, Function *single, GlobalVariable *flag) {
+    LLVMContext &C = F.getContext();
+    // Leave the allocas in the entry block so they stay static.
+    BasicBlock *entry = &F.getEntryBlock();
+    BasicBlock::iterator split = entry->begin();
+    while (isa<AllocaInst>(split)) ++split;
+    BasicBlock *body = SplitBlock(entry, &*split);
+    body->setName("_rmc_multithreaded");
+
+    BasicBlock *fast =
+      BasicBlock::Create(C, "_rmc_single_threaded", &F, body);
+    SmallVector<Value *, 8> args;
+    for (auto & arg : F.args()) args.push_back(&arg);
+    CallInst *call = CallInst::Create(single, args, "", fast);
+    call->setCallingConv(F.getCallingConv());
+    call->setAttributes(F.getAttributes());
+    call->setTailCall();
+    ReturnInst::Create(C, F.getReturnType()->isVoidTy() ? nullptr : call,
+                       fast);
+
+    entry->getTerminator()->eraseFromParent();
+    IRBuilder<> builder(entry);
+    LoadInst *threaded =
+      builder.CreateLoad(flag->getValueType(), flag, "rmc.threaded");
+    threaded->setAtomic(AtomicOrdering::Monotonic);
+    threaded->setAlignment(Align(4));
+    builder.CreateCondBr(builder.CreateIsNotNull(threaded), body, fast);
+  }
+
+  virtual bool runOnModule(Module &M) override {
+    std::vector<Function *> funcs;
+    for (auto & F : M) {
+      if (canVersion(F)) funcs.push_back(&F);
+    }
+    if (funcs.empty()) return false;
+
+    GlobalVariable *flag = cast<GlobalVariable>(
+      M.getOrInsertGlobal("__rmc_multithreaded",
+                          Type::getInt32Ty(M.getContext())));
+    for (auto *F : funcs) {
+      ValueToValueMapTy vmap;
+      Function *single = CloneFunction(F, vmap);
+      single->setName(F->getName() + ".__rmc_single");
+      single->setLinkage(GlobalValue::InternalLinkage);
+      single->setVisibility(GlobalValue::DefaultVisibility);
+      single->setDLLStorageClass(GlobalValue::DefaultStorageClass);
+      single->setComdat(nullptr);
+      single->addFnAttr(kSingleThreadedAttr);
+      stripRMC(*single);
+
+      addDispatch(*F, single, flag);
+    }
+    return true;
+  }
+};
+
+char VersionRMCPass::ID = 0;
+RegisterPass<VersionRMCPass> V("version-rmc",
+                               "Make single-threaded copies of RMC functions");
+
+cl::opt<bool> DoSingleThreadedClones(
+  "rmc-single-threaded-clones",
+  cl::desc("Make barrier free copies of RMC functions to use while the "
+           "program is single-threaded"));
+
+static void registerVersionPass(const PassManagerBuilder &Builder,
+                                legacy::PassManagerBase &PM) {
+  if (DoRMC && DoSingleThreadedClones && !Builder.PerformThinLTO) {
+    PM.add(new VersionRMCPass());
+  }
+}
+static RegisterStandardPasses
+    RegisterVersion(PassManagerBuilder::EP_ModuleOptimizerEarly,
+                    registerVersionPass);
+
 
 // A super bogus pass that deletes all functions except one
 class DropFunsPass : public ModulePass {
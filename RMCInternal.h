@@ -9,6 +9,7 @@
 
 #include <utility>
 #include <tuple>
+#include <set>
 
 #include "PathCache.h"
 
@@ -72,7 +73,7 @@ enum ActionType {
   ActionPrePost,
   ActionNop,
   ActionComplex,
-  ActionSimpleRead,
+  ActionSimpleReads,
   ActionSimpleWrites, // needs to be paired with a dep
   ActionSimpleRMW,
   ActionGive,
@@ -95,6 +96,10 @@ struct Action {
 
   BasicBlock *bb;
   BasicBlock *outBlock;
+  // All of the blocks in the action (which might have a loop in it),
+  // if they make a nice region that is only entered at bb and only
+  // left from outBlock. Empty otherwise.
+  SmallPtrSet<BasicBlock *, 4> blocks;
 
   std::string name;
 
@@ -104,10 +109,36 @@ struct Action {
   int loads{0};
   int RMWs{0};
   int calls{0};
-  bool allSC{false};
+  // Whether some of the loads and stores are in memcpys and such,
+  // which can't be made acquire or release.
+  bool bulk{false};
+  // Whether every access in the action is already at least acquire
+  // (or release), from C11 atomics mixed in with RMC code.
+  bool allAcquire{false};
+  bool allRelease{false};
+  // Whether the action is one side of a remote push
+  bool remotePush{false};
+  // Whether the action already has a fence in it that is as strong as
+  // a sync or an lwsync (a C11 fence, or one of our barriers from RMC
+  // code that got inlined after being compiled). We don't know where
+  // in the action it is, so it only cuts paths that go all the way
+  // through the action.
+  bool hasSync{false};
+  bool hasLwsync{false};
+
+  bool fenceCuts(RMCEdgeType edgeType) const {
+    return hasSync || (hasLwsync && edgeType != PushEdge);
+  }
+  // Is a block in the middle of the action? A cut on an edge out of
+  // one of those wouldn't come after everything in the action.
+  bool isInside(BasicBlock *block) const {
+    return block != outBlock && blocks.count(block);
+  }
 
   Value *outgoingDep{nullptr};
   Use *incomingDep{nullptr};
+  // For writes, the value written, which can also carry a dependency
+  Use *valueDep{nullptr};
 
   // Edges in the graph.
 
@@ -170,6 +201,8 @@ enum CutType {
   CutDmbLd,
   CutSync,
   CutData,
+  CutAddData, // a data dep that we make up
+  CutCsel, // a dep into a write through a conditional select
   CutRelease,
   CutAcquire,
 };
@@ -206,13 +239,65 @@ enum CutStrength {
   HardCut,
 };
 
+//// Cost model, shared between the backends
+
+// Having -1 as a cost indicates not supporting the use of that
+// feature on the architecture. Everything but sync defaults to not
+// supported, since sync is unavoidable.
+//
+// Whether features are enabled gets fed into the DeclMaps/getFunc
+// infrastructure so that operations that are always disabled are
+// hardcoded as false in the SMT system. We also do some direct checks
+// of these flags in various places as an optimization to avoid
+// generating big SMT formulas we know will be false.
+// We could do a lot more pruning.
+struct TuningParams {
+  int syncCost{100}; // mandatory.
+  int lwsyncCost{-1};
+  int dmbstCost{-1};
+  int dmbldCost{-1};
+  int isyncCost{-1};
+  int useCtrlCost{-1};
+  int addCtrlCost{-1};
+  int useDataCost{-1};
+  int addDataCost{-1};
+  int addCselCost{-1};
+  int makeReleaseCost{-1};
+  int makeAcquireCost{-1};
+  bool relAbuse{false};
+};
+inline bool paramEnabled(int param) { return param >= 0; }
+TuningParams archParams(RMCTarget target);
+RMCTarget targetFromTriple(StringRef triple);
+const char *lwsyncAsm(RMCTarget target);
+
+// We represent CFG edges as a pair of BasicBlock*s. Capacity maps
+// also stick node capacities in as <block, nullptr>.
+typedef std::pair<BasicBlock *, BasicBlock *> EdgeKey;
+typedef DenseMap<EdgeKey, int> CapacityMap;
+int successorWeight(const LoopInfo &loops,
+                    BasicBlock *block, BasicBlock *target);
+CapacityMap estimateCapacities(const LoopInfo &loops, Function &F);
+// The SMT solved version; falls back to estimateCapacities without Z3.
+CapacityMap computeCapacities(const LoopInfo &loops, Function &F);
+// Throw away the SMT solver state we keep around between functions.
+void releaseSmtState();
+
+// The inline asm that marks a dependency for the machine level checker
+const char *const kDepMarker = "# rmc dep";
+
 // Utility functions
 bool branchesOn(BasicBlock *bb, Value *load,
-                ICmpInst **icmpOut = nullptr, int *outIdx = nullptr);
+                SmallVectorImpl<Instruction *> *chainOut = nullptr);
 bool addrDepsOn(Use *use, Value *load,
                 PathCache *cache, BasicBlock *bindSite, PathID path,
                 std::vector<std::vector<Instruction *> > *trails = nullptr);
+Use *dataDepsOn(Action &a, Value *load,
+                PathCache *cache, BasicBlock *bindSite, PathID path,
+                std::vector<std::vector<Instruction *> > *trails = nullptr);
 BasicBlock *getSingleSuccessor(BasicBlock *bb);
+bool canAddDataDep(Value *load, Use *use, DominatorTree &domTree);
+Use *getCselTarget(Action &a);
 
 // Class to track the analysis of the function and insert the syncs.
 class RealizeRMC {
@@ -231,6 +316,26 @@ private:
   DenseMap<BasicBlock *, BlockCut> cuts_;
   PathCache pc_;
 
+  // Cost bookkeeping for the greedy algorithm's search
+  const TuningParams params_;
+  CapacityMap greedyCaps_;
+  int64_t planCost_{0};
+  // The dependencies the greedy algorithm relies on, keyed like the
+  // SMT backend's variables for them so that, like the SMT cost
+  // function, we charge for each one only once: control deps by the
+  // load and the CFG edge it is branched on along, data deps by
+  // binding site, source, destination and path.
+  struct DepUses {
+    std::set<std::tuple<Value *, BasicBlock *, BasicBlock *>> ctrl;
+    std::set<std::tuple<BasicBlock *, BasicBlock *, BasicBlock *, PathID>>
+      data;
+  };
+  DepUses usedDeps_;
+  // The optimal cost found by the SMT backend, if it was run
+  int64_t smtCost_{-1};
+  // The greedy solution, as a starting point for the SMT solver
+  std::vector<EdgeCut> greedyHint_;
+
   // Functions
   BasicBlock *splitBlock(BasicBlock *Old, Instruction *SplitPt);
   void fixupBlockNames();
@@ -243,21 +348,52 @@ private:
   Action *getPostAction(Action *a);
 
   TinyPtrVector<Action *> collectEdges(StringRef name);
-  void processEdge(CallInst *call);
+  TinyPtrVector<Action *> bindingClones(
+    CallInst *call, ArrayRef<CallInst *> clones,
+    const TinyPtrVector<Action *> &actions);
+  void processEdge(CallInst *call, ArrayRef<CallInst *> clones);
   bool processPush(CallInst *call);
+  bool processRemotePush(CallInst *call, bool expensive);
 
   // non-SMT compilation
+  bool isRelAcqCut(const RMCEdge &edge);
   CutStrength isPathCut(const RMCEdge &edge, PathID path,
-                        bool enforceSoft, bool justCheckCtrl);
+                        bool enforceSoft, bool justCheckCtrl,
+                        DepUses *uses);
   CutStrength isEdgeCut(const RMCEdge &edge,
-                        bool enforceSoft = false, bool justCheckCtrl = false);
-  bool isCut(const RMCEdge &edge);
-  void cutEdge(RMCEdge &edge);
+                        bool enforceSoft = false, bool justCheckCtrl = false,
+                        DepUses *uses = nullptr);
+  void chargeDeps(const DepUses &uses);
+  // A step of the greedy algorithm: an edge to cut, and whether to
+  // put the barrier (if one is needed) after the source instead of
+  // before the destination.
+  struct GreedyStep {
+    RMCEdge edge;
+    bool atSrc;
+  };
+  typedef std::vector<GreedyStep> GreedyPlan;
+  bool isCut(const RMCEdge &edge, bool enforce = true);
+  void cutEdge(const GreedyStep &step, bool apply = true);
+  int greedyWeight(BasicBlock *bb);
+  int edgeWeight(BasicBlock *src, BasicBlock *dst);
+  int64_t planCost(const GreedyPlan &plan);
+  GreedyPlan searchGreedyPlan();
   void cutEdges();
+  std::vector<EdgeCut> greedyCuts();
+
+  // min-cut compilation of visibility and push edges
+  void flowCutEdges();
 
   // SMT compilation
   void insertCut(const EdgeCut &cut);
-  std::vector<EdgeCut> smtAnalyzeInner();
+  std::vector<EdgeCut> smtAnalyzeInner(const std::vector<RMCEdge> &edges,
+                                       const CapacityMap &edgeCap,
+                                       const std::vector<EdgeCut> &fixed);
+  void smtAnalyzeEdges(const std::vector<RMCEdge> &edges,
+                       const CapacityMap &edgeCap,
+                       std::vector<EdgeCut> &cuts);
+  void smtAnalyzeRegions(const CapacityMap &edgeCap,
+                         std::vector<EdgeCut> &cuts);
   std::vector<EdgeCut> smtAnalyze();
 
 public:
@@ -267,7 +403,7 @@ public:
              RMCTarget target)
     : func_(F), underlyingPass_(underlyingPass),
       domTree_(domTree), loopInfo_(loopInfo),
-      useSMT_(useSMT), target_(target) {}
+      useSMT_(useSMT), target_(target), params_(archParams(target)) {}
   ~RealizeRMC() { }
   bool run();
 };
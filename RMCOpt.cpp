@@ -0,0 +1,332 @@
+// Copyright (c) 2014-2017 Michael J. Sullivan
+// Use of this source code is governed by an MIT-style license that can be
+// found in the LICENSE file.
+
+// rmc-opt: a driver that does what run-rmc does (mem2reg and
+// instcombine, the RMC pass, -O2, and code generation) without
+// shelling out to a half dozen programs and writing out bitcode
+// between each of them. It takes any number of bitcode or textual IR
+// files (from clang -emit-llvm -DHAS_RMC=1) and writes a .s (or .o)
+// next to each one. Intermediate files are only written with
+// -save-temps.
+//
+// With -lto it instead links all of its inputs into one output, doing
+// RMC after inlining across them (see linkFiles).
+//
+// All of the RMC pass's options (-rmc-use-smt, -rmc-cleanup-copies
+// and so on) work like they do with opt.
+//
+// The pass keeps state in globals (the target, the SMT context), so
+// for -j we fork instead of using threads.
+
+#include <llvm/ADT/Triple.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/InitializePasses.h>
+#include <llvm/Pass.h>
+#include <llvm/PassRegistry.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/AlwaysInliner.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Utils.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+using namespace llvm;
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore,
+                                        cl::desc("<input files>"));
+static cl::opt<unsigned> Jobs("j", cl::init(1),
+                              cl::desc("How many files to do at once"));
+static cl::opt<bool> SaveTemps(
+  "save-temps",
+  cl::desc("Write out the IR before and after the RMC pass and after "
+           "optimization"));
+static cl::opt<bool> NoRMC("no-rmc",
+                           cl::desc("Don't run the RMC pass"));
+static cl::opt<bool> EmitObj("c", cl::desc("Write object files"));
+static cl::opt<unsigned> OptLevel("O", cl::Prefix, cl::init(2),
+                                  cl::desc("Optimization level"));
+static cl::opt<std::string> TargetTriple(
+  "mtriple", cl::desc("Override the target triple in the inputs"));
+static cl::opt<std::string> CPU("mcpu", cl::desc("Target CPU"));
+static cl::opt<bool> LinkTime(
+  "lto",
+  cl::desc("Link the inputs together and do RMC after inlining across "
+           "them, like a link time optimizer"));
+static cl::opt<std::string> OutputFile("o", cl::value_desc("filename"),
+                                       cl::desc("Output file for -lto"));
+
+// Run a pass by name. The RMC passes aren't in any header, but they
+// are in the registry.
+static Pass *makePass(StringRef name) {
+  const PassInfo *info = PassRegistry::getPassRegistry()->getPassInfo(name);
+  if (!info) {
+    errs() << "rmc-opt: can't find pass " << name << "\n";
+    exit(1);
+  }
+  return info->createPass();
+}
+
+static bool writeTemp(Module &M, StringRef base, StringRef suffix) {
+  if (!SaveTemps) return true;
+  std::error_code ec;
+  ToolOutputFile out((base + suffix).str(), ec, sys::fs::OF_Text);
+  if (ec) {
+    errs() << "rmc-opt: " << base << suffix << ": " << ec.message() << "\n";
+    return false;
+  }
+  M.print(out.os(), nullptr);
+  out.keep();
+  return true;
+}
+
+static std::unique_ptr<Module> loadModule(StringRef input,
+                                          LLVMContext &context) {
+  SMDiagnostic err;
+  std::unique_ptr<Module> M = parseIRFile(input, err, context);
+  if (!M) {
+    err.print("rmc-opt", errs());
+    return nullptr;
+  }
+  if (!TargetTriple.empty()) M->setTargetTriple(TargetTriple);
+  return M;
+}
+
+static std::unique_ptr<TargetMachine> makeMachine(Module &M) {
+  Triple triple(M.getTargetTriple());
+  std::string error;
+  const Target *target =
+    TargetRegistry::lookupTarget(triple.getTriple(), error);
+  if (!target) {
+    errs() << "rmc-opt: " << M.getModuleIdentifier() << ": " << error << "\n";
+    return nullptr;
+  }
+  std::unique_ptr<TargetMachine> machine(target->createTargetMachine(
+    triple.getTriple(), CPU, "", TargetOptions(), None));
+  M.setDataLayout(machine->createDataLayout());
+  return machine;
+}
+
+static bool emit(Module &M, TargetMachine &machine, StringRef outName) {
+  if (verifyModule(M, &errs())) {
+    errs() << "rmc-opt: " << M.getModuleIdentifier() << ": broken module\n";
+    return false;
+  }
+
+  std::error_code ec;
+  ToolOutputFile out(outName, ec,
+                     EmitObj ? sys::fs::OF_None : sys::fs::OF_Text);
+  if (ec) {
+    errs() << "rmc-opt: " << outName << ": " << ec.message() << "\n";
+    return false;
+  }
+  legacy::PassManager CPM;
+  if (machine.addPassesToEmitFile(
+        CPM, out.os(), nullptr,
+        EmitObj ? CGFT_ObjectFile : CGFT_AssemblyFile)) {
+    errs() << "rmc-opt: can't emit a file of that type\n";
+    return false;
+  }
+  CPM.run(M);
+  out.keep();
+  return true;
+}
+
+// Set up the optimizer the way clang does at our -O level (and so the
+// way run-rmc does), so that we produce the same code. The vectorizers
+// don't do anything without the target's cost model, so the pass
+// managers need that too.
+static void addTargetAnalyses(legacy::PassManagerBase &PM, Module &M,
+                              TargetMachine &machine) {
+  PM.add(new TargetLibraryInfoWrapperPass(Triple(M.getTargetTriple())));
+  PM.add(createTargetTransformInfoWrapperPass(machine.getTargetIRAnalysis()));
+}
+static void setupBuilder(PassManagerBuilder &builder,
+                         TargetMachine &machine) {
+  builder.OptLevel = OptLevel;
+  builder.Inliner = OptLevel > 0 ?
+    createFunctionInliningPass(OptLevel, 0, false) :
+    createAlwaysInlinerLegacyPass();
+  builder.LoopVectorize = OptLevel > 1;
+  builder.SLPVectorize = OptLevel > 1;
+  builder.LoopsInterleaved = OptLevel > 1;
+  builder.DisableUnrollLoops = OptLevel <= 1;
+  machine.adjustPassManager(builder);
+}
+
+static bool compileFile(StringRef input) {
+  LLVMContext context;
+  std::unique_ptr<Module> M = loadModule(input, context);
+  if (!M) return false;
+  std::unique_ptr<TargetMachine> machine = makeMachine(*M);
+  if (!machine) return false;
+
+  SmallString<128> base(input);
+  sys::path::replace_extension(base, "");
+
+  // Cleanup, so that we can find the dependencies, and the RMC pass.
+  {
+    legacy::PassManager PM;
+    PM.add(createPromoteMemoryToRegisterPass());
+    PM.add(createInstructionCombiningPass());
+    PM.run(*M);
+  }
+  if (!writeTemp(*M, base, ".pre.ll")) return false;
+  if (!NoRMC) {
+    legacy::PassManager PM;
+    PM.add(makePass("realize-rmc"));
+    PM.run(*M);
+    if (!writeTemp(*M, base, ".rmc.ll")) return false;
+  }
+
+  // The normal optimizer. The cleanup pass hooks itself in here if
+  // -rmc-cleanup-copies or -rmc-cleanup-safe-copies is given.
+  {
+    PassManagerBuilder builder;
+    setupBuilder(builder, *machine);
+    legacy::FunctionPassManager FPM(M.get());
+    legacy::PassManager MPM;
+    addTargetAnalyses(FPM, *M, *machine);
+    addTargetAnalyses(MPM, *M, *machine);
+    builder.populateFunctionPassManager(FPM);
+    builder.populateModulePassManager(MPM);
+    FPM.doInitialization();
+    for (auto & F : *M) FPM.run(F);
+    FPM.doFinalization();
+    MPM.run(*M);
+  }
+  if (!writeTemp(*M, base, ".opt.ll")) return false;
+
+  return emit(*M, *machine,
+              (base + (EmitObj ? ".o" : ".s")).str());
+}
+
+// -lto: act as the link time optimizer for bitcode that was compiled
+// with "rmc-config --lto", which leaves the RMC markers in. We link
+// everything together and run the LTO pipeline, which does RMC at the
+// end, after inlining across files.
+static bool linkFiles() {
+  if (OutputFile.empty()) {
+    errs() << "rmc-opt: -lto needs -o\n";
+    return false;
+  }
+  LLVMContext context;
+  std::unique_ptr<Module> M = loadModule(InputFiles[0], context);
+  if (!M) return false;
+  Linker linker(*M);
+  for (size_t i = 1; i < InputFiles.size(); i++) {
+    std::unique_ptr<Module> other = loadModule(InputFiles[i], context);
+    if (!other) return false;
+    if (linker.linkInModule(std::move(other))) {
+      errs() << "rmc-opt: couldn't link " << InputFiles[i] << "\n";
+      return false;
+    }
+  }
+  std::unique_ptr<TargetMachine> machine = makeMachine(*M);
+  if (!machine) return false;
+
+  SmallString<128> base(OutputFile);
+  sys::path::replace_extension(base, "");
+  if (!writeTemp(*M, base, ".linked.ll")) return false;
+
+  {
+    PassManagerBuilder builder;
+    setupBuilder(builder, *machine);
+    legacy::PassManager PM;
+    addTargetAnalyses(PM, *M, *machine);
+    builder.populateLTOPassManager(PM);
+    PM.run(*M);
+  }
+  if (!writeTemp(*M, base, ".opt.ll")) return false;
+
+  return emit(*M, *machine, OutputFile);
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+
+  PassRegistry &registry = *PassRegistry::getPassRegistry();
+  initializeCore(registry);
+  initializeTransformUtils(registry);
+  initializeScalarOpts(registry);
+  initializeInstCombine(registry);
+  initializeIPO(registry);
+  initializeAnalysis(registry);
+  initializeCodeGen(registry);
+  initializeTarget(registry);
+
+  cl::ParseCommandLineOptions(argc, argv, "RMC compiler driver\n");
+
+  if (LinkTime) {
+    // The LTO pipeline picks up the RMC pass the same way a linker
+    // with the plugin loaded would, from -rmc-pass.
+    if (!NoRMC) {
+      auto *doRMC = static_cast<cl::opt<bool> *>(
+        cl::getRegisteredOptions().lookup("rmc-pass"));
+      if (!doRMC) {
+        errs() << "rmc-opt: can't find option rmc-pass\n";
+        return 1;
+      }
+      doRMC->setValue(true);
+    }
+    return linkFiles() ? 0 : 1;
+  }
+
+  if (Jobs <= 1) {
+    bool ok = true;
+    for (auto & input : InputFiles) ok &= compileFile(input);
+    return ok ? 0 : 1;
+  }
+
+  // Fork off a child for each file, keeping at most Jobs going.
+  unsigned running = 0;
+  bool ok = true;
+  auto reap = [&] () {
+    int status;
+    if (wait(&status) < 0) return;
+    running--;
+    ok &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  };
+  for (auto & input : InputFiles) {
+    if (running == Jobs) reap();
+    outs().flush();
+    errs().flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("rmc-opt: fork");
+      return 1;
+    }
+    if (pid == 0) _exit(compileFile(input) ? 0 : 1);
+    running++;
+  }
+  while (running > 0) reap();
+  return ok ? 0 : 1;
+}
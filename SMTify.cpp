@@ -15,6 +15,14 @@
 #include <llvm/IR/CFG.h>
 
 #include <llvm/IR/Dominators.h>
+#include <llvm/Analysis/DominanceFrontier.h>
+#include <llvm/Analysis/PostDominators.h>
+#include <llvm/Analysis/RegionInfo.h>
+#include <llvm/ADT/EquivalenceClasses.h>
+#include <llvm/Support/CommandLine.h>
+
+#include <memory>
+#include <set>
 
 #include "smt.h"
 
@@ -38,94 +46,12 @@ const int kFirstUpperBound = 16;
 const bool kCheckFirstGuess = false;
 // Should we invert all bool variables; sort of useful for testing
 const bool kInvertBools = false;
-
-// Costs for different sorts of things that we insert.
-// XXX: These numbers are just made up.
-// And will vary based on platform.
-// (sync == lwsync on ARM but not on POWER and *definitely* not on x86)
-
-// Having -1 as a cost indicates not supporting the use of that
-// feature on the architecture. Everything but sync defaults to not
-// supported, since sync is unavoidable.
-//
-// Whether features are enabled gets fed into the DeclMaps/getFunc
-// infrastructure so that operations that are always disabled are
-// hardcoded as false in the SMT system. We also do some direct checks
-// of these flags in various places as an optimization to avoid
-// generating big SMT formulas we know will be false.
-// We could do a lot more pruning.
-struct TuningParams {
-  int syncCost{100}; // mandatory.
-  int lwsyncCost{-1};
-  int dmbstCost{-1};
-  int dmbldCost{-1};
-  int isyncCost{-1};
-  int useCtrlCost{-1};
-  int addCtrlCost{-1};
-  int useDataCost{-1};
-  int makeReleaseCost{-1};
-  int makeAcquireCost{-1};
-  bool relAbuse{false};
-};
-bool paramEnabled(int param) { return param >= 0; }
-
-// Screw you, C++, for not having designated initializers
-TuningParams x86Params() {
-  TuningParams p;
-  p.syncCost = 800;
-  // this "lwsync" is really just a compiler barrier on x86
-  p.lwsyncCost = 500;
-  // ponder: maybe using release/acquire would be better for compiler
-  // reasons.
-  return p;
-}
-TuningParams powerParams() {
-  TuningParams p;
-  p.syncCost = 800;
-  p.lwsyncCost = 500;
-  p.isyncCost = 200;
-  p.useCtrlCost = 1;
-  p.addCtrlCost = 70;
-  p.useDataCost = 1;
-  return p;
-}
-TuningParams armParams() {
-  TuningParams p;
-  p.syncCost = 500;
-  p.dmbstCost = 350; // XXX???
-  p.useCtrlCost = 1;
-  p.addCtrlCost = 70;
-  p.useDataCost = 1;
-  return p;
-}
-TuningParams armv8Params() {
-  TuningParams p;
-  p.syncCost = 800;
-  p.lwsyncCost = 500;
-  p.dmbstCost = 350; // XXX???
-  p.dmbldCost = 300; // XXX???
-  p.useCtrlCost = 1;
-  p.addCtrlCost = 70;
-  p.useDataCost = 1;
-  p.makeReleaseCost = 240;
-  p.makeAcquireCost = 240;
-  p.relAbuse = true;
-  return p;
-}
-
-TuningParams archParams(RMCTarget target) {
-  if (target == TargetX86) {
-    return x86Params();
-  } else if (target == TargetPOWER) {
-    return powerParams();
-  } else if (target == TargetARM) {
-    return armParams();
-  } else if (target == TargetARMv8) {
-    return armv8Params();
-  }
-  assert(false && "invalid architecture!");
-  std::terminate();
-}
+// Should we split the edges into independent groups and solve each
+// one separately?
+const bool kSplitComponents = true;
+// Should we get our first upper bound by running the greedy algorithm
+// and asking the solver for a solution that uses its barriers?
+const bool kWarmStart = true;
 
 bool debugSpew = false;
 
@@ -182,17 +108,42 @@ Cost findFirstTrue(CostPred pred) {
   return findFirstTrue(pred, lo, hi);
 }
 
+// Find the cost of the solution described by a hint (a set of
+// literals describing a hopefully decent solution), if there is one,
+// by solving under the assumption that it holds. That is usually fast
+// and gives a good upper bound.
+bool hintedUpperBound(SmtSolver &s, SmtExpr &costVar,
+                      const std::vector<SmtExpr> &hint, Cost *upperBound) {
+  if (hint.empty()) return false;
+  z3::expr_vector assumptions(s.ctx());
+  for (auto & lit : hint) assumptions.push_back(lit);
+  if (s.check(assumptions) != z3::sat) return false;
+  *upperBound = extractInt(s.get_model().eval(costVar));
+  if (debugSpew) errs() << "Hinted upper bound: " << *upperBound << "\n";
+  return true;
+}
+
 // Given a solver and an expression, find a solution that minimizes
-// the expression through repeated calls to the solver.
-void handMinimize(SmtSolver &s, SmtExpr &costVar) {
+// the expression through repeated calls to the solver, starting from
+// the hint's cost if we have one.
+void handMinimize(SmtSolver &s, SmtExpr &costVar,
+                  const std::vector<SmtExpr> &hint) {
   auto costPred = [&] (Cost cost) { return isCostUnder(s, costVar, cost); };
-  Cost minCost;
-  if (kGuessUpperBound) {
+  Cost minCost, upperBound;
+  if (hintedUpperBound(s, costVar, hint, &upperBound)) {
+    // The greedy solution is often optimal already, so check that
+    // before searching.
+    if (upperBound == 0 || !costPred(upperBound - 1)) {
+      minCost = upperBound;
+    } else {
+      minCost = findFirstTrue(costPred, 0, upperBound - 1);
+    }
+  } else if (kGuessUpperBound) {
     // This is in theory arbitrarily worse but might be better in
     // practice. Although the cost is bounded by the number of things
     // we could do, so...
     doCheck(s);
-    Cost upperBound = extractInt(s.get_model().eval(costVar));
+    upperBound = extractInt(s.get_model().eval(costVar));
     errs() << "Upper bound: " << upperBound << "\n";
     // The solver seems to often "just happen" to find the optimal
     // solution, so maybe do a quick check on upperBound-1
@@ -211,11 +162,18 @@ void handMinimize(SmtSolver &s, SmtExpr &costVar) {
 
 // Given a solver and an expression, find a solution that minimizes
 // the expression.
-void minimize(SmtSolver &s, SmtExpr &costVar) {
+// The optimizer can't be started from a solution, but the cost of
+// the hint is still a useful upper bound for it.
+void minimize(SmtSolver &s, SmtExpr &costVar,
+              const std::vector<SmtExpr> &hint) {
 #if USE_Z3_OPTIMIZER
+  Cost upperBound;
+  if (hintedUpperBound(s, costVar, hint, &upperBound)) {
+    s.add(costVar <= s.ctx().int_val(upperBound));
+  }
   s.minimize(costVar);
 #else
-  handMinimize(s, costVar);
+  handMinimize(s, costVar, hint);
 #endif
 }
 
@@ -226,7 +184,6 @@ void minimize(SmtSolver &s, SmtExpr &costVar) {
 // Is it worth having our own mapping? Is z3 going to be doing a bunch
 // of string lookups anyways? Dunno.
 typedef BasicBlock* BlockKey;
-typedef std::pair<BasicBlock *, BasicBlock *> EdgeKey;
 typedef PathID PathKey;
 typedef std::pair<BasicBlock *, PathID> BlockPathKey;
 typedef std::pair<EdgeKey, PathID> EdgePathKey;
@@ -328,14 +285,40 @@ SmtExpr getPathFunc(DeclMap<PathKey> &map,
 }
 ///////////////
 
+// Setting up a context is surprisingly expensive compared to the
+// small problems we usually give it, so we keep one context and solver
+// around per thread (and throw them away at the end of each module)
+// and scope each problem we solve with push/pop.
+struct SmtState {
+  SmtContext c;
+  SmtSolver s{c};
+};
+static thread_local std::unique_ptr<SmtState> smtState;
+
+class SmtScope {
+public:
+  SmtScope() {
+    if (!smtState) smtState.reset(new SmtState);
+    smtState->s.push();
+  }
+  ~SmtScope() { smtState->s.pop(); }
+  SmtContext &ctx() { return smtState->c; }
+  SmtSolver &solver() { return smtState->s; }
+};
+
+void llvm::releaseSmtState() {
+  smtState.reset();
+}
+
 // We precompute this so that the solver doesn't need to consider
 // these values while trying to optimize the problems.
 // We should maybe compute these with normal linear algebra instead of
 // giving it to the SMT solver, though.
 // N.B. that capacity gets invented out of nowhere in loops
-DenseMap<EdgeKey, int> computeCapacities(const LoopInfo &loops, Function &F) {
-  SmtContext c;
-  SmtSolver s(c);
+CapacityMap llvm::computeCapacities(const LoopInfo &loops, Function &F) {
+  SmtScope scope;
+  SmtContext &c = scope.ctx();
+  SmtSolver &s = scope.solver();
 
   DeclMap<BasicBlock *> nodeCapM(c.int_sort(), "node_cap");
   DeclMap<EdgeKey> edgeCapM(c.int_sort(), "edge_cap");
@@ -364,15 +347,7 @@ DenseMap<EdgeKey, int> computeCapacities(const LoopInfo &loops, Function &F) {
     // Setup equations for outgoing edges
     auto numerator =
       [&] (BasicBlock *target) {
-      // If the block is a loop exit block, we make the probability
-      // higher for exits that stay in the loop.
-      // TODO: handle loop nesting in a smarter way.
-      auto *loop = loops[&block];
-      if (!loop) return 1;
-      if (target == loop->getHeader() && loop->hasNoExitBlocks()) return 0;
-      if (!loop->isLoopExiting(&block)) return 1;
-      // XXX: Is this logic inverted?
-      return loops[target] == loop ? 1 : 4;
+      return successorWeight(loops, &block, target);
     };
 
     auto i = succ_begin(&block), e = succ_end(&block);
@@ -418,7 +393,7 @@ DenseMap<EdgeKey, int> computeCapacities(const LoopInfo &loops, Function &F) {
   // }
 
   //// Extract a solution.
-  DenseMap<EdgeKey, int> caps;
+  CapacityMap caps;
 
   bool success = doCheck(s);
   assert_(success);
@@ -481,6 +456,9 @@ struct VarMaps {
   // necessarily two blocks connected in the CFG
   DeclMap<std::pair<BlockKey, EdgePathKey>> usesData;
   DeclMap<std::pair<BlockKey, std::pair<PathID, BlockPathKey>>> pathData;
+  // Data deps that we make up, from the action to the action
+  DeclMap<EdgeKey> addsData;
+  DeclMap<EdgeKey> addsCsel;
 };
 
 // Generalized it.
@@ -662,13 +640,30 @@ SmtExpr makeData(SmtSolver &s, VarMaps &m,
                  PathID path, BasicBlock *bindSite) {
   Action *src = m.bb2action[dep];
   Action *tail = m.bb2action[dst];
-  if (src && tail && src->outgoingDep && tail->incomingDep &&
-      addrDepsOn(tail->incomingDep, src->outgoingDep, &m.pc, bindSite, path))
+  if (src && tail && src->outgoingDep &&
+      dataDepsOn(*tail, src->outgoingDep, &m.pc, bindSite, path))
     return getFunc(m.usesData,
                    std::make_pair(makeBlockKey(bindSite),
                                   makeEdgePathKey(src->bb, tail->bb, path)));
 
-  return s.ctx().bool_val(false);
+  // If there isn't one, we can make one up, as long as the load is
+  // available. Since it dominates the destination, the dependency is
+  // from the most recent execution of the source, which is the head
+  // of the path, so it doesn't matter which path we're on.
+  SmtExpr added = s.ctx().bool_val(false);
+  if (!src || !tail || !src->outgoingDep) return added;
+  EdgeKey key = makeEdgeKey(src->bb, tail->bb);
+  if (m.addsData.enabled && tail->incomingDep &&
+      canAddDataDep(src->outgoingDep, tail->incomingDep, m.domTree)) {
+    added = added || getFunc(m.addsData, key);
+  }
+  // Writes can also get one through a conditional select.
+  Use *cselTarget = getCselTarget(*tail);
+  if (m.addsCsel.enabled && cselTarget &&
+      canAddDataDep(src->outgoingDep, cselTarget, m.domTree)) {
+    added = added || getFunc(m.addsCsel, key);
+  }
+  return added;
 }
 
 // Does it make sense for this to be a path variable at all???
@@ -713,6 +708,9 @@ SmtExpr makeEdgeVcut(SmtSolver &s, VarMaps &m,
                      BasicBlock *src, BasicBlock *dst,
                      bool isPush, bool dmbst) {
   if (isPush) {
+    // Remote pushes cut push edges out of them for free.
+    Action *a = m.bb2action.lookup(src);
+    if (a && a->remotePush) return s.ctx().bool_val(true);
     return getEdgeFunc(m.sync, src, dst);
   } else {
     SmtExpr cut = getEdgeFunc(m.lwsync, src, dst) ||
@@ -726,6 +724,7 @@ SmtExpr makeEdgeVcut(SmtSolver &s, VarMaps &m,
 SmtExpr makePathVcut(SmtSolver &s, VarMaps &m,
                      PathID path,
                      bool isPush) {
+  Action *head = m.bb2action.lookup(m.pc.getHead(path));
   bool dmbst = false;
   // XXX: We want to be able to use dmb st to cut visibility edges,
   // which could potentially be a big win. Unfortunately, I think it
@@ -733,7 +732,6 @@ SmtExpr makePathVcut(SmtSolver &s, VarMaps &m,
   // sorts of cuts, because of the path suffix sharing we do... So
   // instead we disable the path suffix sharing...
   if (NO_PATH_SUFFIX_SHARING && m.dmbst.enabled) {
-    Action *head = m.bb2action[m.pc.getHead(path)];
     // If the source is simple writes, we can use a dmb st for
     // visibility. dmb st only orders writes, but visibility edges
     // only meaningfully affect writes.
@@ -748,6 +746,17 @@ SmtExpr makePathVcut(SmtSolver &s, VarMaps &m,
       return getFunc(isPush ? m.pathPcut : m.pathVcut,
                      makeBlockPathKey(nullptr, path), b); },
     [&] (BasicBlock *src, BasicBlock *dst, PathID path) {
+      // Execution paths out of a multi-block action start at the top
+      // of it, and a cut in the middle of it doesn't order all of it.
+      if (head && head->isInside(src)) return s.ctx().bool_val(false);
+      // A fence already in an action cuts a path if the path goes all
+      // the way through the action, which it does if the action
+      // isn't at the end.
+      Action *a = m.bb2action.lookup(dst);
+      if (a && a->fenceCuts(isPush ? PushEdge : VisibilityEdge) &&
+          dst != m.pc.getLast(path)) {
+        return s.ctx().bool_val(true);
+      }
       return makeEdgeVcut(s, m, src, dst, isPush, dmbst);
     });
 }
@@ -761,11 +770,14 @@ SmtExpr makeVcut(SmtSolver &s, VarMaps &m, Action &src, Action &dst,
 SmtExpr makePathDmbldCut(SmtSolver &s, VarMaps &m,
                          PathID path) {
   if (!m.dmbld.enabled) return s.ctx().bool_val(false);
+  Action *head = m.bb2action.lookup(m.pc.getHead(path));
   return forAllPathEdges(
     s, m, path,
     [&] (PathID path, bool *b) {
       return getPathFunc(m.pathDmbld, path, b); },
     [&] (BasicBlock *src, BasicBlock *dst, PathID path) {
+      // See makePathVcut
+      if (head && head->isInside(src)) return s.ctx().bool_val(false);
       return getEdgeFunc(m.dmbld, src, dst);
     });
 }
@@ -805,14 +817,23 @@ SmtExpr makePathXcut(SmtSolver &s, VarMaps &m,
 }
 
 
+// We can only strengthen the accesses in a single block action (and
+// for one with a loop in it, we wouldn't want to), and not ones that
+// are hiding in a memcpy. We also only do it when there is just one
+// access: the cost model charges for one acquire or release, but each
+// access would get its own (which on POWER means its own barrier).
+bool canStrengthen(const Action &a) {
+  return a.bb == a.outBlock && !a.bulk &&
+    a.loads + a.stores + a.RMWs == 1;
+}
 SmtExpr getRelease(SmtSolver &s, VarMaps &m, Action &a) {
-  if (a.allSC) return s.ctx().bool_val(true);
-  if (!m.release.enabled) return s.ctx().bool_val(false);
+  if (a.allRelease) return s.ctx().bool_val(true);
+  if (!m.release.enabled || !canStrengthen(a)) return s.ctx().bool_val(false);
   return getEdgeFunc(m.release, a.bb, getSingleSuccessor(a.bb));
 }
 SmtExpr getAcquire(SmtSolver &s, VarMaps &m, Action &a) {
-  if (a.allSC) return s.ctx().bool_val(true);
-  if (!m.acquire.enabled) return s.ctx().bool_val(false);
+  if (a.allAcquire) return s.ctx().bool_val(true);
+  if (!m.acquire.enabled || !canStrengthen(a)) return s.ctx().bool_val(false);
   return getEdgeFunc(m.acquire, a.bb, getSingleSuccessor(a.bb));
 }
 
@@ -841,7 +862,7 @@ SmtExpr makeRelAcqCut(SmtSolver &s, VarMaps &m, Action &src, Action &dst,
   }
   // R/RW1 -x-> *   -- R/RW1 = acq
   if (type == ExecutionEdge &&
-      (src.type == ActionSimpleRead || src.type == ActionSimpleRMW)) {
+      (src.type == ActionSimpleReads || src.type == ActionSimpleRMW)) {
     relAcq = relAcq || getAcquire(s, m, src);
   }
   // R/RW1 -v-> W/RW2 -- complicated
@@ -849,7 +870,7 @@ SmtExpr makeRelAcqCut(SmtSolver &s, VarMaps &m, Action &src, Action &dst,
   // release, we can do an R->W vis edge by marking both.
   if (!m.params.relAbuse &&
       (type == VisibilityEdge || type == ExecutionEdge) &&
-      (src.type == ActionSimpleRead || src.type == ActionSimpleRMW) &&
+      (src.type == ActionSimpleReads || src.type == ActionSimpleRMW) &&
       (dst.type == ActionSimpleWrites || dst.type == ActionSimpleRMW)) {
 
     relAcq = relAcq || (getRelease(s, m, dst) &&
@@ -903,17 +924,143 @@ void processMap(DeclMap<T> &map, SmtModel &model,
   }
 }
 
-std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
-  // XXX: Workaround a Z3 bug. When 'enable_sat' is set, we sometimes
-  // hit an exception (which should probably be an assertion) in
-  // inc_sat_solver. Setting opt.enable_set=false disables
-  // inc_sat_solver, which makes the problem go away.
-  // I should try to minimize this and file a bug.
-  z3::set_param("opt.enable_sat", false);
+// Call f on every block that the constraints for an edge can
+// mention: every variable we generate for an edge is keyed by some of
+// the blocks on the paths that its constraints talk about (or by its
+// actions' blocks).
+//
+// For execution edges we also need the cycles through the source,
+// since makeXcut will want the source to be cut from itself. We don't
+// skip the binding site for those because allPathsCtrl doesn't.
+template<class F>
+void forEdgeBlocks(PathCache &pc, const RMCEdge &edge, F f) {
+  auto addPaths = [&] (BasicBlock *src, BasicBlock *dst,
+                       BasicBlock *skipBlock) {
+    PathCache::SkipSet skip;
+    if (skipBlock) skip.insert(skipBlock);
+    for (auto path : pc.findAllSimplePaths(&skip, src, dst)) {
+      for (auto *block : pc.extractPath(path)) f(block);
+    }
+  };
+
+  f(edge.src->bb);
+  f(edge.dst->bb);
+  if (edge.edgeType == ExecutionEdge) {
+    addPaths(edge.src->bb, edge.dst->bb, edge.bindSite);
+    addPaths(edge.src->bb, edge.src->bb, nullptr);
+  } else {
+    addPaths(edge.src->outBlock, edge.dst->bb, edge.bindSite);
+  }
+}
+
+// Split the edges into groups that can't possibly share any
+// variables in the SMT problem, so that we can solve them separately.
+// Edges whose paths touch disjoint sets of blocks are independent.
+std::vector<std::vector<RMCEdge>> splitComponents(
+    PathCache &pc, const std::vector<RMCEdge> &edges) {
+  EquivalenceClasses<BasicBlock *> blocks;
+  for (auto & edge : edges) {
+    BasicBlock *rep = edge.src->bb;
+    forEdgeBlocks(pc, edge, [&] (BasicBlock *block) {
+      blocks.unionSets(rep, block);
+    });
+  }
+
+  // Group the edges, keeping them in their original order.
+  std::vector<std::vector<RMCEdge>> components;
+  DenseMap<BasicBlock *, unsigned> index;
+  for (auto & edge : edges) {
+    BasicBlock *leader = blocks.getLeaderValue(edge.src->bb);
+    auto entry = index.insert(std::make_pair(leader, components.size()));
+    if (entry.second) components.emplace_back();
+    components[entry.first->second].push_back(edge);
+  }
+  return components;
+}
+
+cl::opt<bool> LazyPaths(
+  "rmc-smt-lazy-paths",
+  cl::desc("Only give the SMT solver the path constraints that the "
+           "solutions it finds don't already satisfy"));
+
+// For lazy (counterexample guided) mode, we keep track of the paths
+// for each edge and which ones we have actually told the solver about.
+struct LazyEdge {
+  const RMCEdge *edge;
+  SmtExpr relAcqCut;
+  PathList paths;
+  std::set<PathID> added;
+};
+
+LazyEdge makeLazyEdge(SmtSolver &s, VarMaps &m, const RMCEdge &edge) {
+  bool isExec = edge.edgeType == ExecutionEdge;
+  PathCache::SkipSet skip;
+  if (edge.bindSite) skip.insert(edge.bindSite);
+  BasicBlock *src = isExec ? edge.src->bb : edge.src->outBlock;
+  return LazyEdge{
+    &edge,
+    makeRelAcqCut(s, m, *edge.src, *edge.dst, edge.edgeType),
+    m.pc.findAllSimplePaths(&skip, src, edge.dst->bb),
+    {}};
+}
+
+void addLazyPath(SmtSolver &s, VarMaps &m, LazyEdge &lazy, PathID path) {
+  const RMCEdge &edge = *lazy.edge;
+  SmtExpr pathCut = edge.edgeType == ExecutionEdge ?
+    makePathXcut(s, m, path, *edge.dst, edge.bindSite) :
+    makePathVcut(s, m, path, edge.edgeType == PushEdge);
+  s.add(lazy.relAcqCut || pathCut);
+  lazy.added.insert(path);
+}
+
+// Find a path for an edge that we haven't told the solver about that
+// the model doesn't cut, or kEmptyPath if there aren't any. We only
+// recognize barriers here; if a path is cut some other way, we'll just
+// add it and let the solver figure it out.
+PathID findUncutPath(VarMaps &m, SmtModel &model, LazyEdge &lazy) {
+  const RMCEdge &edge = *lazy.edge;
+  if (extractBool(model.eval(lazy.relAcqCut, true))) {
+    return PathCache::kEmptyPath;
+  }
+
+  auto isSet = [&] (DeclMap<EdgeKey> &map, BasicBlock *src, BasicBlock *dst) {
+    auto i = map.map.find(makeEdgeKey(src, dst));
+    return i != map.map.end() && extractBool(model.eval(i->second, true));
+  };
+  // As in makePathVcut, cuts inside a multi-block action at the head
+  // of a path don't count.
+  Action *head = nullptr;
+  auto edgeCut = [&] (BasicBlock *src, BasicBlock *dst) {
+    if (head && head->isInside(src)) return false;
+    if (isSet(m.sync, src, dst)) return true;
+    if (edge.edgeType == PushEdge) return false;
+    if (isSet(m.lwsync, src, dst)) return true;
+    if (edge.src->type == ActionSimpleWrites && isSet(m.dmbst, src, dst)) {
+      return true;
+    }
+    return edge.edgeType == ExecutionEdge && isSet(m.dmbld, src, dst);
+  };
+
+  for (PathID path : lazy.paths) {
+    if (lazy.added.count(path)) continue;
+    Path blocks = m.pc.extractPath(path);
+    head = blocks.empty() ? nullptr : m.bb2action.lookup(blocks[0]);
+    bool cut = false;
+    for (unsigned i = 0; i + 1 < blocks.size() && !cut; i++) {
+      cut = edgeCut(blocks[i], blocks[i+1]);
+    }
+    if (!cut) return path;
+  }
+  return PathCache::kEmptyPath;
+}
 
+std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner(
+    const std::vector<RMCEdge> &edges, const CapacityMap &edgeCap,
+    const std::vector<EdgeCut> &fixed) {
   TuningParams params = archParams(target_);
-  SmtContext c;
-  SmtSolver s(c);
+  SmtScope scope;
+  SmtContext &c = scope.ctx();
+  SmtSolver &s = scope.solver();
 
 #if LONG_PATH_NAMES
   debugPathCache = &pc_; /* :( */
@@ -959,10 +1106,12 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
       paramEnabled(params.useDataCost)),
     DeclMap<std::pair<BlockKey, std::pair<PathID, BlockPathKey>>>(
       c.bool_sort(), "path_data"),
+    DeclMap<EdgeKey>(c.bool_sort(), "adds_data",
+                     paramEnabled(params.addDataCost)),
+    DeclMap<EdgeKey>(c.bool_sort(), "adds_csel",
+                     paramEnabled(params.addCselCost)),
   };
 
-  // Compute the capacity function
-  DenseMap<EdgeKey, int> edgeCap = computeCapacities(loopInfo_, func_);
   auto weight =
     [&] (BasicBlock *src, BasicBlock *dst) {
     // The weight of an edge is based on its graph capacity and its loop depth.
@@ -972,13 +1121,18 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
     // XXX: Turning that all off in favor of trying to be smarter about
     // probabilities for loop exits.
     //return edgeCap[makeEdgeKey(src, dst)]*pow(4, loopInfo_.getLoopDepth(src));
-    return edgeCap[makeEdgeKey(src, dst)];
+    return edgeCap.lookup(makeEdgeKey(src, dst));
   };
 
   //////////
   // HOK. Make sure everything is cut.
-  for (auto & edge : edges_) {
-    if (edge.edgeType == ExecutionEdge) {
+  // In lazy mode, we instead start out with none of the paths and add
+  // them as we find models that don't cut them.
+  std::vector<LazyEdge> lazyEdges;
+  for (auto & edge : edges) {
+    if (LazyPaths) {
+      lazyEdges.push_back(makeLazyEdge(s, m, edge));
+    } else if (edge.edgeType == ExecutionEdge) {
       s.add(makeXcut(s, m, *edge.src, *edge.dst, edge.bindSite));
     } else {
       s.add(makeVcut(s, m, *edge.src, *edge.dst, edge.bindSite, edge.edgeType));
@@ -1002,58 +1156,139 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
     { m.acquire, params.makeAcquireCost, CutAcquire },
   };
 
-  //////////
-  // OK, now build a cost function. This will probably take a lot of
-  // tuning.
-  SmtExpr costVar = c.int_const("cost");
-  SmtExpr cost = c.int_val(0);
-
-  BasicBlock *src, *dst;
-  SmtExpr v = c.bool_val(false);
+  // Barriers that have already been placed (by solving an inner
+  // region) are there for free.
+  std::set<std::pair<CutType, EdgeKey>> fixedCuts;
+  for (auto & cut : fixed) {
+    fixedCuts.insert(std::make_pair(cut.type, makeEdgeKey(cut.src, cut.dst)));
+  }
+  auto isFixed = [&] (CutType type, EdgeKey edge) {
+    return fixedCuts.count(std::make_pair(type, edge)) > 0;
+  };
 
-  // Cost for all edge cutting actions
-  for (auto & cuttype : cuttypes) {
-    for (auto & entry : cuttype.map.map) {
+  SmtExpr costVar = c.int_const("cost");
+  auto solve = [&] () {
+    // In lazy mode, everything we add here gets thrown away if we need
+    // to go around again.
+    if (LazyPaths) s.push();
+
+    //////////
+    // OK, now build a cost function. This will probably take a lot of
+    // tuning.
+    SmtExpr cost = c.int_val(0);
+
+    BasicBlock *src, *dst;
+    SmtExpr v = c.bool_val(false);
+
+    // Cost for all edge cutting actions
+    for (auto & cuttype : cuttypes) {
+      for (auto & entry : cuttype.map.map) {
+        unpack(unpack(src, dst), v) = fix_pair(entry);
+        if (isFixed(cuttype.type, makeEdgeKey(src, dst))) {
+          s.add(v);
+          continue;
+        }
+        cost = cost +
+          boolToInt(v, cuttype.cost*weight(src, dst)+1);
+      }
+    }
+    // Ctrl cost
+    for (auto & entry : m.usesCtrl.map) {
+      BasicBlock *dep;
+      unpack(unpack(dep, unpack(src, dst)), v) = fix_pair(entry);
+      auto ctrlWeight =
+        branchesOn(src, bb2action_[dep]->outgoingDep) ?
+          params.useCtrlCost : params.addCtrlCost;
+      cost = cost +
+        boolToInt(v, ctrlWeight*weight(src, dst));
+    }
+    // Data dep cost
+    for (auto & entry : m.usesData.map) {
+      PathID path;
+      BasicBlock *bindSite;
+      unpack(unpack(bindSite, unpack(unpack(src, dst), path)), v) =
+        fix_pair(entry);
+      // XXX: this is a hack that depends on us only using actions in
+      // usesData things
+      BasicBlock *pred = bb2action_[dst]->bb->getSinglePredecessor();
+      cost = cost +
+        boolToInt(v, params.useDataCost*weight(pred, dst));
+    }
+    for (auto & entry : m.addsData.map) {
       unpack(unpack(src, dst), v) = fix_pair(entry);
+      BasicBlock *pred = dst->getSinglePredecessor();
       cost = cost +
-        boolToInt(v, cuttype.cost*weight(src, dst)+1);
+        boolToInt(v, params.addDataCost*weight(pred, dst));
+    }
+    for (auto & entry : m.addsCsel.map) {
+      unpack(unpack(src, dst), v) = fix_pair(entry);
+      BasicBlock *pred = dst->getSinglePredecessor();
+      cost = cost +
+        boolToInt(v, params.addCselCost*weight(pred, dst));
     }
-  }
-  // Ctrl cost
-  for (auto & entry : m.usesCtrl.map) {
-    BasicBlock *dep;
-    unpack(unpack(dep, unpack(src, dst)), v) = fix_pair(entry);
-    auto ctrlWeight =
-      branchesOn(src, bb2action_[dep]->outgoingDep) ?
-        params.useCtrlCost : params.addCtrlCost;
-    cost = cost +
-      boolToInt(v, ctrlWeight*weight(src, dst));
-  }
-  // Data dep cost
-  for (auto & entry : m.usesData.map) {
-    PathID path;
-    BasicBlock *bindSite;
-    unpack(unpack(bindSite, unpack(unpack(src, dst), path)), v) =
-      fix_pair(entry);
-    // XXX: this is a hack that depends on us only using actions in
-    // usesData things
-    BasicBlock *pred = bb2action_[dst]->bb->getSinglePredecessor();
-    cost = cost +
-      boolToInt(v, params.useDataCost*weight(pred, dst));
-  }
 
-  s.add(costVar == cost.simplify());
+    s.add(costVar == cost.simplify());
 
-  //////////
-  // Print out the model for debugging
-  if (debugSpew) dumpSolver(s);
+    //////////
+    // Print out the model for debugging
+    if (debugSpew) dumpSolver(s);
 
-  // Optimize the cost.
-  minimize(s, costVar);
+    // Build a hint out of the greedy solution: its barriers and nothing
+    // else. Dependencies are left up to the solver.
+    std::set<std::pair<CutType, EdgeKey>> greedy;
+    for (auto & cut : greedyHint_) {
+      greedy.insert(std::make_pair(cut.type, makeEdgeKey(cut.src, cut.dst)));
+    }
+    std::vector<SmtExpr> hint;
+    if (kWarmStart) {
+      for (auto & cuttype : cuttypes) {
+        for (auto & entry : cuttype.map.map) {
+          EdgeKey edge = entry.first;
+          if (isFixed(cuttype.type, edge)) continue;
+          bool used = greedy.count(std::make_pair(cuttype.type, edge)) > 0;
+          hint.push_back(used ? entry.second : !entry.second);
+        }
+      }
+    }
 
-  // OK, go solve it.
-  doCheck(s);
-  SmtModel model = s.get_model();
+    // Optimize the cost.
+    minimize(s, costVar, hint);
+
+    // OK, go solve it.
+    doCheck(s);
+    return s.get_model();
+  };
+  SmtModel model = solve();
+
+  // In lazy mode, find a path that isn't cut for each edge that has
+  // one, add those, and go again until everything is cut.
+  int rounds = 1;
+  while (LazyPaths) {
+    std::vector<std::pair<LazyEdge *, PathID>> missing;
+    for (auto & edge : lazyEdges) {
+      PathID path = findUncutPath(m, model, edge);
+      if (!m.pc.isEmpty(path)) missing.push_back(std::make_pair(&edge, path));
+    }
+    if (missing.empty()) break;
+
+    s.pop();
+    for (auto & entry : missing) {
+      addLazyPath(s, m, *entry.first, entry.second);
+    }
+    model = solve();
+    rounds++;
+  }
+  if (LazyPaths) {
+    int added = 0, total = 0;
+    for (auto & edge : lazyEdges) {
+      added += edge.added.size();
+      total += edge.paths.size();
+    }
+    errs() << "Lazy paths: " << rounds << " rounds, " <<
+      added << "/" << total << " paths\n";
+  }
+
+  smtCost_ += extractInt(model.eval(costVar));
 
   // Print out the results for debugging
   if (debugSpew) dumpModel(model);
@@ -1063,6 +1298,7 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
   // Find all edge cuts to insert
   for (auto & cuttype : cuttypes) {
     processMap<EdgeKey>(cuttype.map, model, [&] (EdgeKey &edge) {
+      if (isFixed(cuttype.type, edge)) return;
       cuts.push_back(EdgeCut(cuttype.type, edge.first, edge.second));
     });
   }
@@ -1083,16 +1319,130 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
     Value *read = bb2action_[src]->outgoingDep;
     cuts.push_back(EdgeCut(CutData, src, dst, read, bindSite, path));
   });
+  // And data deps to make up
+  processMap<EdgeKey>(m.addsData, model, [&] (EdgeKey &edge) {
+    Value *read = bb2action_[edge.first]->outgoingDep;
+    cuts.push_back(EdgeCut(CutAddData, edge.first, edge.second, read));
+  });
+  processMap<EdgeKey>(m.addsCsel, model, [&] (EdgeKey &edge) {
+    Value *read = bb2action_[edge.first]->outgoingDep;
+    cuts.push_back(EdgeCut(CutCsel, edge.first, edge.second, read));
+  });
 
 
   if (debugSpew) errs() << "\n";
 
+  if (LazyPaths) s.pop();
   return cuts;
 }
 
+// Solve for a set of edges, adding the results to cuts. Anything
+// already in cuts is taken as given.
+void RealizeRMC::smtAnalyzeEdges(const std::vector<RMCEdge> &edges,
+                                 const CapacityMap &edgeCap,
+                                 std::vector<EdgeCut> &cuts) {
+  std::vector<std::vector<RMCEdge>> components;
+  if (kSplitComponents) {
+    components = splitComponents(pc_, edges);
+  } else {
+    components.push_back(edges);
+  }
+  if (debugSpew) {
+    errs() << "Solving " << components.size() << " components\n";
+  }
+
+  // The components are independent, so the cuts and costs just add
+  // up. (We could solve them in parallel, but the PathCache isn't
+  // thread safe.)
+  for (auto & component : components) {
+    auto componentCuts = smtAnalyzeInner(component, edgeCap, cuts);
+    cuts.insert(cuts.end(), componentCuts.begin(), componentCuts.end());
+  }
+}
+
+cl::opt<unsigned> SMTRegionBlocks(
+  "rmc-smt-region-blocks",
+  cl::desc("Solve SESE regions separately, innermost first, in functions "
+           "with more than this many blocks (0 to never)"),
+  cl::init(0));
+
+// For really big functions, solving everything at once can take
+// forever. Instead, we work up the SESE region tree from the
+// innermost regions, solving each region's edges (the ones whose
+// paths don't leave it) as their own problem. Barriers placed while
+// solving inner regions are given to the enclosing ones for free, so
+// outer edges can reuse them, but they can't be moved or removed,
+// which can cost us some optimality. (We only fix the barriers that
+// were placed, not the absence of the others, since edges that aren't
+// local to a region can still have paths that are entirely inside it
+// and would be uncuttable otherwise.)
+void RealizeRMC::smtAnalyzeRegions(const CapacityMap &edgeCap,
+                                   std::vector<EdgeCut> &cuts) {
+  PostDominatorTree postDomTree(func_);
+  DominanceFrontier domFrontier;
+  domFrontier.analyze(domTree_);
+  RegionInfo regions;
+  regions.recalculate(func_, &domTree_, &postDomTree, &domFrontier);
+
+  // Figure out which blocks each edge cares about.
+  std::vector<std::pair<RMCEdge, SmallPtrSet<BasicBlock *, 8>>> pending;
+  for (auto & edge : edges_) {
+    pending.emplace_back(edge, SmallPtrSet<BasicBlock *, 8>());
+    forEdgeBlocks(pc_, edge, [&] (BasicBlock *block) {
+      pending.back().second.insert(block);
+    });
+  }
+
+  std::function<void (Region *)> solve = [&] (Region *region) {
+    for (auto & child : *region) solve(child.get());
+
+    // The top level region is the whole function and gets everything
+    // that is left.
+    bool isTop = region->isTopLevelRegion();
+    std::vector<RMCEdge> local;
+    auto i = std::stable_partition(
+      pending.begin(), pending.end(),
+      [&] (const std::pair<RMCEdge, SmallPtrSet<BasicBlock *, 8>> &entry) {
+        if (isTop) return false;
+        for (auto *block : entry.second) {
+          if (!region->contains(block)) return true;
+        }
+        return false;
+      });
+    for (auto j = i; j != pending.end(); ++j) local.push_back(j->first);
+    pending.erase(i, pending.end());
+    if (local.empty()) return;
+
+    if (debugSpew) {
+      errs() << "Solving region " << region->getNameStr() << "\n";
+    }
+    smtAnalyzeEdges(local, edgeCap, cuts);
+  };
+  solve(regions.getTopLevelRegion());
+  assert(pending.empty());
+}
+
 std::vector<EdgeCut> RealizeRMC::smtAnalyze() {
+  // XXX: Workaround a Z3 bug. When 'enable_sat' is set, we sometimes
+  // hit an exception (which should probably be an assertion) in
+  // inc_sat_solver. Setting opt.enable_set=false disables
+  // inc_sat_solver, which makes the problem go away.
+  // I should try to minimize this and file a bug.
+  z3::set_param("opt.enable_sat", false);
+
   try {
-    return smtAnalyzeInner();
+    // Compute the capacity function
+    CapacityMap edgeCap = computeCapacities(loopInfo_, func_);
+    if (kWarmStart) greedyHint_ = greedyCuts();
+
+    smtCost_ = 0;
+    std::vector<EdgeCut> cuts;
+    if (SMTRegionBlocks && func_.size() > SMTRegionBlocks) {
+      smtAnalyzeRegions(edgeCap, cuts);
+    } else {
+      smtAnalyzeEdges(edges_, edgeCap, cuts);
+    }
+    return cuts;
   } catch (z3::exception &e) {
     errs() << "Unexpected Z3 error: " << e.msg() << "\n";
     std::terminate();
@@ -1103,7 +1453,13 @@ std::vector<EdgeCut> RealizeRMC::smtAnalyze() {
 #else /* !USE_Z3 */
 #include <exception>
 using namespace llvm;
-std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner() {
+CapacityMap llvm::computeCapacities(const LoopInfo &loops, Function &F) {
+  return estimateCapacities(loops, F);
+}
+void llvm::releaseSmtState() {}
+std::vector<EdgeCut> RealizeRMC::smtAnalyzeInner(
+    const std::vector<RMCEdge> &edges, const CapacityMap &edgeCap,
+    const std::vector<EdgeCut> &fixed) {
   std::terminate();
 }
 std::vector<EdgeCut> RealizeRMC::smtAnalyze() {
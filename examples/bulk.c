@@ -0,0 +1,48 @@
+#include <rmc.h>
+#include <string.h>
+
+// Labeled statements that copy a bunch of data. These should get
+// classified as reads or writes (not complex), and the barriers for
+// them need to go after the whole copy, not inside of it. Try them
+// with --smt, with and without -rmc-smt-lazy-paths.
+
+#define N 8
+
+typedef struct payload { long words[N]; } payload;
+
+// A seqlock style read: the copy is a loop, so its action has
+// multiple blocks.
+int read_loop(rmc_int *seq, long *data, long *out) {
+    XEDGE(pre_seq, copy);
+    XEDGE(copy, post_seq);
+
+    long tmp[N];
+    int s1 = L(pre_seq, rmc_load(seq));
+    LS(copy, for (int i = 0; i < N; i++) tmp[i] = data[i]);
+    int s2 = L(post_seq, rmc_load(seq));
+    if (s1 != s2 || (s1 & 1)) return 0;
+    memcpy(out, tmp, sizeof(tmp));
+    return 1;
+}
+
+// The same thing, but with a memcpy into a local.
+int read_memcpy(rmc_int *seq, payload *data, payload *out) {
+    XEDGE(pre_seq, copy);
+    XEDGE(copy, post_seq);
+
+    payload tmp;
+    int s1 = L(pre_seq, rmc_load(seq));
+    LS(copy, memcpy(&tmp, data, sizeof(tmp)));
+    int s2 = L(post_seq, rmc_load(seq));
+    if (s1 != s2 || (s1 & 1)) return 0;
+    *out = tmp;
+    return 1;
+}
+
+// Filling in a payload with a loop and then publishing it.
+void write_loop(rmc_int *flag, long *data, long v) {
+    VEDGE(fill, publish);
+
+    LS(fill, for (int i = 0; i < N; i++) data[i] = v + i);
+    L(publish, rmc_store(flag, 1));
+}
@@ -13,6 +13,46 @@
 
 namespace rmc {
 
+#if RMC_FALLBACK_TAGS && !defined(HAS_RMC)
+// Support for the RMC_FALLBACK_TAGS fallback in rmc-core.h. The
+// lookup of a label's role functions happens in a generic lambda, so
+// that when one isn't declared it is a substitution failure in has()
+// instead of an error. Everything is decided by the types, so all
+// that is left at runtime is the fences.
+namespace __tags {
+struct probe {};
+
+template<class F>
+inline auto has(F f, int) -> decltype(f(probe{}), std::true_type{}) {
+  return {};
+}
+template<class F>
+inline std::false_type has(F, long) { return {}; }
+
+template<bool xdst, bool vdst, bool pdst, bool xpost, bool vpost, bool ppost>
+struct fences {
+  static inline void before() {
+    if (pdst) {
+      __sync_synchronize();
+    } else if (xdst || vdst) {
+      std::atomic_thread_fence(std::memory_order_acq_rel);
+    }
+  }
+  static inline void after() {
+    if (ppost) {
+      __sync_synchronize();
+    } else if (xpost || vpost) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+  }
+};
+
+template<class XD, class VD, class PD, class XP, class VP, class PP>
+inline fences<XD::value, VD::value, PD::value, XP::value, VP::value, PP::value>
+roles(XD, VD, PD, XP, VP, PP) { return {}; }
+}
+#endif
+
 // RMC_YOLO_FALLBACK exists to test how badly things fail if we
 // /don't/ insert any hardware barriers. For those tests are are only
 // interested in what the hardware does, and not the compiler, so we
@@ -140,6 +180,10 @@ RMC_FORCE_INLINE
 static inline int push() { return __rmc_push(); }
 RMC_FORCE_INLINE
 static inline void push_here() { __rmc_push_here(); }
+RMC_FORCE_INLINE
+static inline void push_cheap_here() { __rmc_push_cheap_here(); }
+RMC_FORCE_INLINE
+static inline void push_expensive_here() { __rmc_push_expensive_here(); }
 
 }
 
@@ -6,7 +6,10 @@
 #define RMC_CORE_H
 
 #define RMC_FORCE_INLINE __attribute__((always_inline))
-#define RMC_NODUPLICATE __attribute__((noduplicate))
+#define RMC_CONVERGENT __attribute__((convergent))
+
+#define RCAT(x,y)      x ## y
+#define XRCAT(x,y)     RCAT(x,y)
 
 #ifdef HAS_RMC
 
@@ -16,9 +19,9 @@
  * and __rmc_action_close which indicate the extent of the action and
  * associate it with a name. __rmc_action_close is passed the (bogus)
  * return value from __rmc_action_register in order to make them easy
- * to associate (even if they are duplicated by an optimizer (although
- * we ban this now)). Edges are specified by calling a dummy function
- * __rmc_edge_register with the names of the labels as arguments.
+ * to associate (even if they are duplicated by an optimizer). Edges
+ * are specified by calling a dummy function __rmc_edge_register with
+ * the names of the labels as arguments.
  *
  * I'm not totally sure how fragile this is at this point. The pass
  * should definitely be run after mem2reg and I suspect that it is
@@ -28,10 +31,6 @@
  * and fall back to inserting barriers after all the labels... */
 
 
-/* C. */
-#define RCAT(x,y)      x ## y
-#define XRCAT(x,y)     RCAT(x,y)
-
 #ifdef __cplusplus
 #define RMC_NOEXCEPT noexcept
 extern "C" {
@@ -39,28 +38,55 @@ extern "C" {
 #define RMC_NOEXCEPT
 #endif
 
-// RMC_NODUPLICATE prevents any transformation that would introduce
-// more call sites to a function. This prevents some transformations
-// that would cause problems by getting rid of the 1:1 correspondence
-// of register() and close() calls as well as preventing inlining
-// (except when there is exactly one call site).
+// RMC_CONVERGENT prevents transformations that would make a call
+// control dependent on something new, like jump threading and loop
+// unswitching. Those are the ones that could get rid of the 1:1
+// correspondence of register() and close() calls. We used to use
+// noduplicate, but that also prevents inlining (except when there is
+// exactly one call site) and loop unrolling, which copy whole
+// actions; the backend can deal with those.
 // The extra dummy argument to __rmc_action_register is to prevent
-// registers from getting merged when they have the same label.
+// registers from getting merged when they have the same label. The
+// one to __rmc_edge_register lets the pass tell copies of one edge
+// that the optimizer made apart from separately written edges.
 // RMC_NOEXCEPT tells clang that they can't throw exceptions,
 // so it will generate calls instead of invokes.
 extern int __rmc_action_register(const char *name, int dummy)
-  RMC_NOEXCEPT RMC_NODUPLICATE;
-extern int __rmc_action_close(int x) RMC_NOEXCEPT RMC_NODUPLICATE;
+  RMC_NOEXCEPT RMC_CONVERGENT;
+extern int __rmc_action_close(int x) RMC_NOEXCEPT RMC_CONVERGENT;
 extern int __rmc_edge_register(int edge_type, const char *src, const char *dst,
-                               int bind_here)
-  RMC_NOEXCEPT RMC_NODUPLICATE;
-extern int __rmc_push(void) RMC_NOEXCEPT RMC_NODUPLICATE;
+                               int bind_here, int dummy)
+  RMC_NOEXCEPT RMC_CONVERGENT;
+extern int __rmc_push(void) RMC_NOEXCEPT RMC_CONVERGENT;
+extern int __rmc_push_cheap(void) RMC_NOEXCEPT RMC_CONVERGENT;
+extern int __rmc_push_expensive(void) RMC_NOEXCEPT RMC_CONVERGENT;
+// The expensive side of a remote push calls this, which the program
+// needs to provide. It has to make every other running thread execute
+// a full barrier (with sys_membarrier or signals, say; see
+// case_studies/remote_push.hpp).
+extern void rmc_remote_push_trigger(void) RMC_NOEXCEPT;
+
+// When compiled with -rmc-single-threaded-clones, RMC functions check
+// this and run a barrier free copy of themselves while it is unset.
+// It starts out set, since nothing notices when a program creates a
+// thread: a program that wants the clones has to call
+// rmc_assume_single_threaded() while it only has one thread, and then
+// rmc_become_multithreaded() before any other thread might run RMC
+// code (so, before creating threads, not when a new thread first
+// shows up). It is weak so that the header can define it.
+__attribute__((weak)) int __rmc_multithreaded = 1;
+static inline void rmc_assume_single_threaded(void) {
+  __atomic_store_n(&__rmc_multithreaded, 0, __ATOMIC_SEQ_CST);
+}
+static inline void rmc_become_multithreaded(void) {
+  __atomic_store_n(&__rmc_multithreaded, 1, __ATOMIC_SEQ_CST);
+}
 
 #ifdef __cplusplus
 }
 #endif
 
-#define RMC_EDGE(t, x, y, h) __rmc_edge_register(t, #x, #y, h)
+#define RMC_EDGE(t, x, y, h) __rmc_edge_register(t, #x, #y, h, __COUNTER__)
 
 // This is unhygenic in a nasty way.
 // Maybe we should throw some barrier()s in also, to be on the safe side?
@@ -75,7 +101,7 @@ extern int __rmc_push(void) RMC_NOEXCEPT RMC_NODUPLICATE;
 #define LTRANSFER_(label, expr, is_take, ctr)         \
   L(label, ({                                         \
         extern __rmc_typeof(expr) XRCAT(__rmc_transfer_, ctr)(  \
-          __rmc_typeof(expr), int) RMC_NOEXCEPT RMC_NODUPLICATE; \
+          __rmc_typeof(expr), int) RMC_NOEXCEPT RMC_CONVERGENT; \
         XRCAT(__rmc_transfer_, ctr)((expr), is_take);                  \
       }))
 #define LTRANSFER(label, expr, is_take)         \
@@ -93,16 +119,71 @@ extern int __rmc_push(void) RMC_NOEXCEPT RMC_NODUPLICATE;
 // implementation based on making all atomic operations sequentially
 // consistent.
 
-#define RMC_EDGE(t, x, y, h) do { } while (0)
+#define rmc_assume_single_threaded() ((void)0)
+#define rmc_become_multithreaded() ((void)0)
+#define LTRANSFER(label, expr, is_take) L(label, expr)
+
+#if RMC_FALLBACK_TAGS
+#ifndef __cplusplus
+#error RMC_FALLBACK_TAGS only works in C++
+#endif
+
+// A smarter fallback for C++, where the atomic ops are relaxed and
+// labeled statements get fences based on what edges they are on.
+// Each edge declares a (never defined) function named after its
+// destination, and LS looks up which of those are in scope for its
+// label (see rmc::__tags in rmc++.h). The destination of an execution
+// or visibility edge gets an acq_rel fence before it, which orders
+// everything before it (loads and stores) with it and costs the same
+// as a release fence; so "VEDGE(init, publish)" turns into a release
+// store. Since "post" isn't a real label, edges to it are named after
+// the source as well, and the source gets an acquire fence after it;
+// so "XEDGE(read, post)" is an acquire load. Push edges get full
+// fences instead.
+//
+// This gives the same guarantees as RMC_DISABLE_PEDGE's rel/acq, as
+// long as edges come before the labeled statements they talk about,
+// in the same block or an enclosing one. (Anything else gets missed!)
+#define RMC_EDGE(t, x, y, h)                                    \
+  int __rmc_tag_dst##t##_##y(::rmc::__tags::probe);             \
+  int __rmc_tag_src##t##_##x##__##y(::rmc::__tags::probe)
+
+#define __rmc_tag_has(name)                                     \
+  ::rmc::__tags::has([](auto __p) -> decltype(name(__p)) { return {}; }, 0)
+#define __rmc_tag_roles(label)                                  \
+  ::rmc::__tags::roles(                                         \
+    __rmc_tag_has(__rmc_tag_dst0_##label),                      \
+    __rmc_tag_has(__rmc_tag_dst1_##label),                      \
+    __rmc_tag_has(__rmc_tag_dst2_##label),                      \
+    __rmc_tag_has(__rmc_tag_src0_##label##__post),              \
+    __rmc_tag_has(__rmc_tag_src1_##label##__post),              \
+    __rmc_tag_has(__rmc_tag_src2_##label##__post))
+
+#define LS(label, stmt)                                         \
+  __rmc_tag_roles(label).before();                              \
+  stmt;                                                         \
+  __rmc_tag_roles(label).after()
 
+#define __rmc_load_order memory_order_relaxed
+#define __rmc_store_order memory_order_relaxed
+#define __rmc_rmw_order memory_order_relaxed
+#define __rmc_push() (__sync_synchronize(), 0)
+
+#else /* !RMC_FALLBACK_TAGS */
+
+#define RMC_EDGE(t, x, y, h) do { } while (0)
 #define LS(label, stmt) stmt
-#define LTRANSFER(label, expr, is_take) L(label, expr)
+
+#endif
 
 // What orders to use for the atomic ops. We generally use seq_cst,
 // but if RMC_DISABLE_PEDGE is set, then push edges are turned off,
 // which means we can get away with using release/acquire for the
 // memory orders.
-#if !RMC_DISABLE_PEDGE || RMC_FALLBACK_USE_SC
+#if RMC_FALLBACK_TAGS
+// Taken care of above
+
+#elif !RMC_DISABLE_PEDGE || RMC_FALLBACK_USE_SC
 #define __rmc_load_order memory_order_seq_cst
 #define __rmc_store_order memory_order_seq_cst
 #define __rmc_rmw_order memory_order_seq_cst
@@ -128,10 +209,17 @@ extern int __rmc_push(void) RMC_NOEXCEPT RMC_NODUPLICATE;
 // (SC fences aren't actually as strong as pushes). Of course, the
 // interactions between __sync_synchronize() (which is a "full sync")
 // and C11 atomics are totally unspecified, so...
-#define __rmc_push() ({ __sync_synchronize(); 0; })
+// Not a statement expression, since those can't go in the decltype
+// in the C++ __rmc_typeof.
+#define __rmc_push() (__sync_synchronize(), 0)
 
 #endif /* fallbacks */
 
+// Without compiler support, both sides of a remote push are just
+// pushes.
+#define __rmc_push_cheap() __rmc_push()
+#define __rmc_push_expensive() __rmc_push()
+
 #endif /* HAS_RMC */
 
 // Shared stuff for both backends.
@@ -177,4 +265,17 @@ extern int __rmc_push(void) RMC_NOEXCEPT RMC_NODUPLICATE;
 #define __rmc_push_here_internal(l) do { L(l, __rmc_push()); VEDGE(pre, l); XEDGE(l, post); } while (0)
 #define __rmc_push_here() __rmc_push_here_internal(XRCAT(__barrier_push, __COUNTER__))
 
+// Asymmetric pushes, for when one side runs much more often than the
+// other (like the read side of epochs or RCU). The cheap side compiles
+// to a compiler barrier and the expensive side to a call to
+// rmc_remote_push_trigger(); together they cut push edges that go
+// through either one. Unlike push_here(), they don't draw any other
+// edges, since that would cost barriers on the cheap side.
+#define __rmc_push_cheap_here()                                 \
+  do { L(XRCAT(__cheap_push, __COUNTER__), __rmc_push_cheap()); } while (0)
+#define __rmc_push_expensive_here()                                     \
+  do {                                                                  \
+    L(XRCAT(__expensive_push, __COUNTER__), __rmc_push_expensive());    \
+  } while (0)
+
 #endif
@@ -18,6 +18,8 @@
 
 #define rmc_push() __rmc_push()
 #define rmc_push_here() __rmc_push_here()
+#define rmc_push_cheap_here() __rmc_push_cheap_here()
+#define rmc_push_expensive_here() __rmc_push_expensive_here()
 #define rmc_bind_inside() __rmc_bind_inside()
 
 // Now define the RMC atomic op instructions. We do this by using the